@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <gtc/packing.hpp>
+
+// Transform of one drawn instance: the top three rows of an affine matrix,
+// whose bottom row is always (0, 0, 0, 1). 48 bytes instead of the 64 of a
+// glm::mat4, uploaded unchanged as three vec4 instance attributes.
+struct AffineInstance {
+    glm::vec4 rows[3];
+
+    AffineInstance() = default;
+    explicit AffineInstance(const glm::mat4& matrix)
+        : rows{ glm::vec4(matrix[0][0], matrix[1][0], matrix[2][0], matrix[3][0]),
+                glm::vec4(matrix[0][1], matrix[1][1], matrix[2][1], matrix[3][1]),
+                glm::vec4(matrix[0][2], matrix[1][2], matrix[2][2], matrix[3][2]) } {}
+
+    glm::mat4 ToMat4() const {
+        return glm::transpose(glm::mat4(rows[0], rows[1], rows[2], glm::vec4(0.0f, 0.0f, 0.0f, 1.0f)));
+    }
+
+    glm::vec3 Translation() const {
+        return glm::vec3(rows[0].w, rows[1].w, rows[2].w);
+    }
+};
+
+// matrix * instance, for an affine `matrix`; only its top three rows are used
+inline AffineInstance operator*(const glm::mat4& matrix, const AffineInstance& instance) {
+    AffineInstance result;
+    for (int r = 0; r < 3; r++) {
+        result.rows[r] = matrix[0][r] * instance.rows[0] + matrix[1][r] * instance.rows[1]
+            + matrix[2][r] * instance.rows[2] + glm::vec4(0.0f, 0.0f, 0.0f, matrix[3][r]);
+    }
+    return result;
+}
+
+// Quantized instance of 32 bytes: the rotation-scale block as half floats,
+// row by row, and the translation at full precision so that instances far
+// from the origin stay in place. Halves keep 11 significant bits, enough for
+// the orientation and size of a branch or leaf.
+struct PackedAffineInstance {
+    uint16_t linear[10];  // the last half only aligns the translation
+    float translation[3];
+
+    PackedAffineInstance() = default;
+    explicit PackedAffineInstance(const AffineInstance& instance) {
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) {
+                linear[r * 3 + c] = glm::packHalf1x16(instance.rows[r][c]);
+            }
+            translation[r] = instance.rows[r].w;
+        }
+        linear[9] = 0;
+    }
+};
+
+static_assert(sizeof(AffineInstance) == 48, "three vec4 rows");
+static_assert(sizeof(PackedAffineInstance) == 32, "ten halves and three floats");
@@ -1,9 +1,11 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <glm/vec3.hpp>
+#include <cstdint>
 #include <vector>
 #include "tree_nodes.h"
 #include "common_types.h"
+#include "spatial_grid.h"
 
 struct Envelope {
     glm::vec3 position = { 0.0f, 0.0f, 0.0f };  // bottom center
@@ -20,13 +22,52 @@ public:
     /* constructor */
     AttractionPointManager(Envelope envelope);
 
-    void UpdateLinks(TreeNodeManager& tree_node_manager, const float influence_radius, const float min_distance);
+    // Link every unreached point to its closest node within `influence_radius` and mark the
+    // points within `min_distance` of a node reached. Incrementally, only the points within
+    // reach of the nodes appended since the last call are looked at, each point keeping its
+    // closest distance so far, and only their rows of `links` are patched. The links are
+    // those of a full update except for a point exactly as close to two nodes: the
+    // incremental update keeps the older node, a full one the first node in grid order
+    void UpdateLinks(TreeNodeManager& tree_node_manager, const float influence_radius, const float min_distance,
+        bool incremental = false);
     int GetAvailablePointNumber();
     void DebugPrintPoints(TreeNodeManager& tree_node_manager);
-    std::vector<AttractionPoint> attraction_points;
+    AttractionPointStore attraction_points;
     Envelope envelope;
+    NodePointLinks links;  // points linked to every tree node, rebuilt by UpdateLinks
 
 private:
     void EvenlyDistribute();
     void CreatePoints();
+
+    void UpdateLinksIncremental(TreeNodeManager& tree_node_manager, const float influence_radius, const float min_distance);
+    // Set the reached bits of the points flagged POINT_REACHED_NOW. The linking
+    // loops only flag them: threads setting bits of one word would race
+    void MarkReachedNow();
+    // Two passes over the points: count the links of every node, prefix-sum
+    // the counts into offsets and scatter the point indices. Per-chunk counts
+    // keep the threads from sharing a counter and fix the order of the result
+    void BuildLinks(size_t node_count);
+    // Incremental counterpart of BuildLinks, in time of the candidates and new nodes:
+    // shrink the rows the changed points leave and append rows for nodes from `first_new`
+    void PatchLinks(size_t first_new, size_t node_count);
+
+    SpatialGrid node_grid;                  // tree nodes, or only the new ones when incremental
+    std::vector<float> node_x;              // their coordinates, gathered for the grid build
+    std::vector<float> node_y;
+    std::vector<float> node_z;
+
+    // State of incremental updates
+    SpatialGrid point_grid;                 // attraction points, built when linking starts over
+    std::vector<float> closest_distances;   // squared distance of every point to its linked node
+    std::vector<uint8_t> point_flags;       // POINT_CANDIDATE and POINT_REACHED_NOW, cleared after every update
+    std::vector<uint32_t> link_histograms;  // links per node and point chunk, then write cursors
+    std::vector<uint32_t> candidates;       // points within reach of a new node
+    std::vector<int32_t> listed_nodes;      // row of `links` every point is in, -1 if none
+    std::vector<uint32_t> reached_listed;   // points reached by the last update, still listed once
+    std::vector<uint32_t> shrunk_nodes;     // rows a changed point left
+    std::vector<uint32_t> inserted;         // changed points that join a new row
+    size_t listed_count = 0;                // entries of links.point_indices in use
+    size_t linked_node_count = 0;           // nodes the links account for, 0 to start over
+    float linked_radius = 0.0f;
 };
\ No newline at end of file
@@ -1,23 +1,49 @@
 #pragma once
 #include <glm/glm.hpp>
 #include <glm/vec3.hpp>
+#include <cstdint>
 #include <vector>
 
-struct TreeNode;  // Forward declaration
-struct AttractionPoint;  // Forward declaration
+struct AttractionPointStore;  // Forward declaration
 
 // Define all shared types in one place
-struct TreeNode {
-    glm::vec3 position;
-    std::vector<AttractionPoint*> linked_points;
 
-    size_t parent = 0;
-    std::vector<size_t> children;
-    float radius = 1.0f;
+// Attraction points as a structure of arrays: the linking kernels load the
+// coordinates of several points at once and the reached flags pack 64 to a word
+struct AttractionPointStore {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<uint64_t> reached;      // bit p % 64 of word p / 64
+    std::vector<int32_t> linked_node;   // -1 if none
+
+    size_t Size() const { return x.size(); }
+    glm::vec3 Position(size_t p) const { return glm::vec3(x[p], y[p], z[p]); }
+    bool Reached(size_t p) const { return (reached[p >> 6] >> (p & 63)) & 1; }
+    // Points sharing a word share its bits, threads must not set them concurrently
+    void SetReached(size_t p) { reached[p >> 6] |= uint64_t(1) << (p & 63); }
+
+    void Add(const glm::vec3& position) {
+        if (Size() % 64 == 0) reached.push_back(0);
+        x.push_back(position.x);
+        y.push_back(position.y);
+        z.push_back(position.z);
+        linked_node.push_back(-1);
+    }
 };
 
-struct AttractionPoint {
-    glm::vec3 position;
-    bool reached = false;;
-    size_t linked_node = -1;
+// Attraction points linked to every tree node in sparse rows: node i is linked to
+// attraction_points[point_indices[j]] for j in [node_starts[i], node_ends[i]), in
+// point order. The rows follow each other in node order; incremental updates shrink
+// rows in place, so unused entries may lie between them.
+// Indices stay valid when the point array grows, unlike pointers
+struct NodePointLinks {
+    std::vector<uint32_t> node_starts;    // one entry per node
+    std::vector<uint32_t> node_ends;
+    std::vector<uint32_t> point_indices;
+
+    // Nodes appended after the links were built have none
+    uint32_t Begin(size_t node) const { return node < node_starts.size() ? node_starts[node] : 0; }
+    uint32_t End(size_t node) const { return node < node_ends.size() ? node_ends[node] : 0; }
+    bool Empty(size_t node) const { return Begin(node) == End(node); }
 };
\ No newline at end of file
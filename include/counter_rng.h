@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+
+// Counter-based random numbers (Philox4x32-10). A draw is a pure function of
+// (seed, index, domain, draw number), so results are reproducible and do not
+// depend on which thread asks for them or in what order.
+//   index  - position of the thing being randomized, e.g. a symbol or a node
+//   domain - separates independent uses of the same index
+class CounterRng {
+public:
+    CounterRng(uint64_t seed, uint64_t index, uint32_t domain = 0)
+        : key0(static_cast<uint32_t>(seed)), key1(static_cast<uint32_t>(seed >> 32)),
+        index0(static_cast<uint32_t>(index)), index1(static_cast<uint32_t>(index >> 32)),
+        domain(domain), block(0), used(4) {}
+
+    uint32_t NextUInt() {
+        if (used == 4) {
+            Generate();
+            used = 0;
+        }
+        return output[used++];
+    }
+
+    // Uniform in [0, 1)
+    float NextFloat() {
+        return (NextUInt() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Uniform in [min, max]
+    int UniformInt(int min, int max) {
+        if (max <= min) return min;
+        const uint64_t range = static_cast<uint64_t>(static_cast<int64_t>(max) - min) + 1;
+        return min + static_cast<int>((static_cast<uint64_t>(NextUInt()) * range) >> 32);
+    }
+
+    // Uniform in [min, max)
+    float Uniform(float min, float max) {
+        return min + (max - min) * NextFloat();
+    }
+
+    // Draw number n is word n % 4 of block n / 4; vectorized generators
+    // (see leaf_batch.cpp) compute several blocks at once with these constants
+    static constexpr int ROUNDS = 10;
+    static constexpr uint32_t MULTIPLIER0 = 0xD2511F53u;
+    static constexpr uint32_t MULTIPLIER1 = 0xCD9E8D57u;
+    static constexpr uint32_t KEY_STEP0 = 0x9E3779B9u;
+    static constexpr uint32_t KEY_STEP1 = 0xBB67AE85u;
+
+private:
+    void Generate() {
+        uint32_t c0 = index0, c1 = index1, c2 = domain, c3 = block++;
+        uint32_t k0 = key0, k1 = key1;
+        for (int round = 0; round < ROUNDS; round++) {
+            const uint64_t product0 = static_cast<uint64_t>(MULTIPLIER0) * c0;
+            const uint64_t product1 = static_cast<uint64_t>(MULTIPLIER1) * c2;
+            const uint32_t hi0 = static_cast<uint32_t>(product0 >> 32), lo0 = static_cast<uint32_t>(product0);
+            const uint32_t hi1 = static_cast<uint32_t>(product1 >> 32), lo1 = static_cast<uint32_t>(product1);
+            c0 = hi1 ^ c1 ^ k0;
+            c1 = lo1;
+            c2 = hi0 ^ c3 ^ k1;
+            c3 = lo0;
+            k0 += KEY_STEP0;
+            k1 += KEY_STEP1;
+        }
+        output[0] = c0;
+        output[1] = c1;
+        output[2] = c2;
+        output[3] = c3;
+    }
+
+    uint32_t key0, key1;
+    uint32_t index0, index1;
+    uint32_t domain;
+    uint32_t block;
+    uint32_t output[4];
+    int used;
+};
@@ -0,0 +1,60 @@
+#pragma once
+#include "affine_instance.h"
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Destination of the instance transforms a generator emits. Generators only
+// append and never read back, so a sink can keep them in a host vector or
+// write them straight into GPU memory, see MeshRenderer::MappedInstanceSink.
+class InstanceSink {
+public:
+    virtual ~InstanceSink() = default;
+
+    // Room for `count` more instances, appends up to that do not move the storage
+    virtual void reserve(size_t count) = 0;
+    // Append `count` instances for the caller to fill in and return the first.
+    // The range is write-only and valid until the next call on the sink
+    virtual AffineInstance* extend(size_t count) = 0;
+    virtual size_t size() const = 0;
+    // Drop the instances past the first `count`, used to give back unwritten slots of extend
+    virtual void truncate(size_t count) = 0;
+
+    virtual void append(const AffineInstance* instances, size_t count) {
+        std::copy(instances, instances + count, extend(count));
+    }
+    virtual void append(const AffineInstance& instance) {
+        *extend(1) = instance;
+    }
+};
+
+// Sink appending to a host vector
+class VectorInstanceSink : public InstanceSink {
+public:
+    explicit VectorInstanceSink(std::vector<AffineInstance>& instances) : instances(instances) {}
+
+    void reserve(size_t count) override {
+        instances.reserve(instances.size() + count);
+    }
+    AffineInstance* extend(size_t count) override {
+        instances.resize(instances.size() + count);
+        return instances.data() + instances.size() - count;
+    }
+    size_t size() const override {
+        return instances.size();
+    }
+    void truncate(size_t count) override {
+        if (count < instances.size()) instances.resize(count);
+    }
+
+    // Without the zero-fill of extend
+    void append(const AffineInstance* first, size_t count) override {
+        instances.insert(instances.end(), first, first + count);
+    }
+    void append(const AffineInstance& instance) override {
+        instances.push_back(instance);
+    }
+
+private:
+    std::vector<AffineInstance>& instances;
+};
@@ -0,0 +1,37 @@
+#pragma once
+#include "instance_sink.h"
+#include <atomic>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+// Cluster of leaves around a point of the tree, recorded while the tree is
+// walked and generated afterwards together with every other cluster.
+// Leaf i draws an angle and an x and y offset from CounterRng(seed, index,
+// domain), starting at draw firstDraw + 3 * i, so a cluster comes out the
+// same however the clusters are batched or split between threads.
+struct LeafSite {
+    glm::mat4 anchor;
+    uint64_t index;
+    uint64_t seed;
+    uint32_t domain;
+    uint32_t firstDraw;
+    uint32_t count;
+    float scale;
+    bool translate;  // offset the leaves within the plane of the cluster
+};
+
+// Append the leaves of `sites` to `leafTransforms`, in site order. Random
+// numbers are generated several blocks at a time in SIMD lanes and leaf
+// transforms are built with SSE2, large batches on all cores.
+// False if `cancel` was set before every site was generated, the sink then holds part of the leaves
+bool generateLeafBatch(const std::vector<LeafSite>& sites, InstanceSink& leafTransforms,
+    const std::atomic<bool>* cancel = nullptr);
+
+// Thin the clusters of `sites` to `budget` leaves in total, when they hold
+// more. A cluster keeps count * min(1, k * exposure) leaves, with k chosen so
+// the total meets the budget: exposure grows with the distance from the
+// centroid of all leaves, so the outside of the crown stays full and hidden
+// clusters inside it lose most of their leaves. A thinned cluster keeps its
+// first leaves, which are generated exactly as before.
+void distributeLeafBudget(std::vector<LeafSite>& sites, uint64_t budget);
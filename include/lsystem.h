@@ -0,0 +1,448 @@
+#pragma once
+#include "instance_sink.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <gtc/quaternion.hpp>
+#include <initializer_list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Symbols skipped when matching context unless LSystemParameters::contextIgnored says otherwise
+#define LSYSTEM_CONTEXT_IGNORED "+-&^/\\"
+// Deepest derivation ever run, whatever the budgets allow. Grammars that grow
+// slowly or not at all would otherwise derive a typed depth generation by generation
+#define LSYSTEM_MAX_DEPTH 1024
+
+// One successor of a rule, chosen with probability weight / total weight of its rule.
+// A production with a context only applies where the symbols before (`left`) and
+// after (`right`) the predecessor on its branch match, e.g. A < B > C -> D is
+// {'B', {{"D", 1.0f, "A", "C"}}}. Side branches and ignored symbols are skipped
+// while matching and the most specific applicable productions win; a symbol
+// none of whose productions apply is left unchanged.
+struct LSystemProduction {
+    std::string successor;
+    float weight = 1.0f;
+    std::string left{};
+    std::string right{};
+};
+
+// Productions of one symbol. A rule with a single production is deterministic,
+// so plain strings convert to a rule: {'F', "F[+F]"} or {'F', {{"F[+F]", 2.0f}, {"F[-F]", 1.0f}}}
+struct LSystemRule {
+    std::vector<LSystemProduction> productions;
+
+    LSystemRule() = default;
+    LSystemRule(const char* successor) : productions{ { successor, 1.0f } } {}
+    LSystemRule(const std::string& successor) : productions{ { successor, 1.0f } } {}
+    LSystemRule(std::initializer_list<LSystemProduction> productions) : productions(productions) {}
+
+    bool operator==(const LSystemRule& other) const {
+        if (productions.size() != other.productions.size()) return false;
+        for (size_t i = 0; i < productions.size(); i++) {
+            if (productions[i].successor != other.productions[i].successor ||
+                productions[i].weight != other.productions[i].weight ||
+                productions[i].left != other.productions[i].left ||
+                productions[i].right != other.productions[i].right) return false;
+        }
+        return true;
+    }
+    bool operator!=(const LSystemRule& other) const { return !(*this == other); }
+};
+
+struct LSystemParameters {
+    int depth;
+    float scaleFactor;
+    float branchRadius;
+    int minLeafCount;
+    int maxLeafCount;
+    float xAngle;
+    float yAngle;
+    float zAngle;
+    std::string axiom;
+    std::unordered_map<char, LSystemRule> rules;
+    // Formal parameters of parametric rules, e.g. {'F', "l,w"} for F(l,w) -> F(l*0.7,w*0.8).
+    // The grammar is parametric as soon as the axiom or a rule has a module like F(1,0.1)
+    std::unordered_map<char, std::string> formalParameters{};
+    std::string contextIgnored = LSYSTEM_CONTEXT_IGNORED;  // symbols that are not context of a production
+    bool streamDerivation = false;  // hand symbols to the turtle as they are derived instead of expanding the whole string
+    bool instanceSubtrees = false;  // derive every (symbol, generations left) subtree once and place copies of it
+    int maxInstances = 5000000;     // deeper trees are clamped so branches + leaves stay under this
+    int maxMemoryMB = 2048;         // and so the expanded string and transforms stay under this
+    int seed = 0;                   // key of every random choice, the same seed always grows the same tree
+    int leafBudget = 0;             // total leaves, spread over the clusters by exposure; 0 keeps every cluster whole
+
+    bool operator==(const LSystemParameters& other) const {
+        return depth == other.depth && scaleFactor == other.scaleFactor && branchRadius == other.branchRadius &&
+            minLeafCount == other.minLeafCount && maxLeafCount == other.maxLeafCount &&
+            xAngle == other.xAngle && yAngle == other.yAngle && zAngle == other.zAngle &&
+            axiom == other.axiom && rules == other.rules && formalParameters == other.formalParameters &&
+            contextIgnored == other.contextIgnored && streamDerivation == other.streamDerivation &&
+            instanceSubtrees == other.instanceSubtrees && maxInstances == other.maxInstances &&
+            maxMemoryMB == other.maxMemoryMB && seed == other.seed && leafBudget == other.leafBudget;
+    }
+    bool operator!=(const LSystemParameters& other) const { return !(*this == other); }
+};
+
+// Size of a derivation, predicted from the symbol production-count matrix
+struct LSystemSizePrediction {
+    uint64_t symbols = 0;   // length of the expanded string, exact unless the rules are stochastic or context-sensitive
+    uint64_t branches = 0;  // upper bound: every 'F' plus every 'X' and 'Y', which branch at random
+    uint64_t leaves = 0;    // upper bound: every 'L' with the maximum leaf count
+    uint64_t leafSites = 0; // every 'L', each recorded as a LeafSite before a leaf budget thins them
+    uint64_t moduleWords = 0;  // parametric grammars: header and parameter words of the module string
+    uint64_t literals = 0;     // parametric grammars: modules with parameters, each may add a turtle transform
+
+    // Memory of the expanded string, its compiled program, the leaf sites and the emitted transforms
+    uint64_t Bytes(bool materialized) const;
+};
+
+class LSystemModuleString;
+class LSystemProgramCache;
+struct LSystemPrecompiledNode;
+struct LSystemPrecompiledProgram;
+
+// L-system rewriting rules compiled into a dense table indexed by symbol.
+// Symbols without a rule map to themselves, so derivation needs no hashing
+// and every generation is written into a buffer sized exactly once.
+// Stochastic rules pick a production from a counter-based generator keyed by
+// (seed, generation, position in the generation), so a choice never depends
+// on the order or the thread in which symbols are rewritten.
+// Context-sensitive rules look their context up in per-generation tables of
+// the nearest symbol before and after every position on its branch, built in
+// one pass each, so matching costs O(context length) instead of a bracket scan.
+class LSystemGrammar {
+public:
+    /* constructor */
+    LSystemGrammar(const std::string& axiom, const std::unordered_map<char, LSystemRule>& rules, int seed = 0,
+        const std::string& contextIgnored = LSYSTEM_CONTEXT_IGNORED);
+
+    // Grammar of `params`. For parametric grammars this is the symbol skeleton,
+    // the same rules with every parameter list removed. It rewrites every module of
+    // a symbol with a rule, so it derives as many modules and makes the same stochastic
+    // choices as the parametric grammar only when every rule applies to every module
+    // of its symbol, which LSystemParametricGrammar checks.
+    static LSystemGrammar FromParameters(const LSystemParameters& params);
+    static bool IsParametric(const LSystemParameters& params);
+
+    // Exact length of the generation that follows `current`, generation number `generation`
+    size_t NextLength(const std::string& current, int generation) const;
+    // Rewrite `current`, generation number `generation`, into `next`, resizing
+    // `next` once to its exact length. Long strings are rewritten in blocks on
+    // all cores: block lengths are prefix-summed into offsets and each block
+    // writes its own output slice.
+    void Rewrite(const std::string& current, std::string& next, int generation) const;
+    // Expand the axiom `depth` times
+    std::string Expand(int depth) const;
+    // Walk the derivation tree depth-first and call `visit` with every symbol of
+    // generation `depth` in order, without materializing any generation.
+    // Only one stack frame per generation is alive at a time.
+    // Context-free grammars only, a symbol's right context is not derived yet.
+    // `visit` returns false to stop the walk, Derive then returns false
+    template <typename Visitor>
+    bool Derive(int depth, Visitor&& visit) const;
+
+    // Production replacing `c` at position `index` of generation `generation`, context aside
+    const std::string& Successor(char c, int generation, uint64_t index) const {
+        const unsigned char symbol = static_cast<unsigned char>(c);
+        return is_stochastic[symbol] ? Choose(symbol, generation, index) : productions[symbol];
+    }
+    bool HasRule(char c) const { return !is_identity[static_cast<unsigned char>(c)]; }
+    bool IsStochastic() const { return stochastic; }
+    bool IsContextSensitive() const { return context_sensitive; }
+
+    // Sizes of generations 0..depth. Counts per symbol are pushed through the
+    // production-count matrix, so this costs microseconds a generation.
+    // Stochastic and context-sensitive rules count the most of every symbol
+    // any of their productions (or leaving the symbol unchanged) has.
+    // A positive `leafBudget` caps the leaves, see LSystemParameters::leafBudget.
+    // Stops early once the counts saturate or stop changing, and at
+    // LSYSTEM_MAX_DEPTH: the last entry then stands for every deeper generation
+    std::vector<LSystemSizePrediction> Predict(int depth, int maxLeafCount, int leafBudget = 0) const;
+    // Deepest depth up to `params.depth` that fits the instance and memory budgets,
+    // and whose generations context-sensitive rules can index with 32 bits.
+    // Stops at the first generation over a budget, so any depth costs the same
+    int ClampDepth(const LSystemParameters& params) const;
+
+    std::string axiom;
+    int seed;
+    std::string contextIgnored;
+
+private:
+    // Position of the nearest symbol before and after every position of a generation
+    // on the same branch: side branches and ignored symbols are skipped, NO_SYMBOL
+    // past the start or end of the branch
+    struct ContextTables {
+        static constexpr uint32_t NO_SYMBOL = 0xFFFFFFFFu;
+
+        const char* symbols;
+        std::vector<uint32_t> left;
+        std::vector<uint32_t> right;
+    };
+    struct ContextProduction {
+        std::string left;
+        std::string right;
+        std::string successor;
+        float weight;
+        int specificity;  // number of contexts the production requires
+    };
+
+    // Call visit(generation, prediction) for the generations Predict returns
+    // until it returns false. True unless `visit` or saturated counts stopped it
+    template <typename Visitor>
+    bool PredictGenerations(int depth, int maxLeafCount, int leafBudget, Visitor&& visit) const;
+
+    void BuildContext(const std::string& current, ContextTables& context) const;
+    bool MatchesContext(const ContextProduction& production, const ContextTables& context, uint64_t index) const;
+    const std::string& ChooseInContext(unsigned char symbol, int generation, uint64_t index, const ContextTables& context) const;
+    const std::string& Choose(unsigned char symbol, int generation, uint64_t index) const;
+    size_t CountRange(const char* begin, const char* end, int generation, uint64_t index, const ContextTables* context) const;
+    void WriteRange(const char* begin, const char* end, int generation, uint64_t index, const ContextTables* context, char* out) const;
+
+    std::array<std::string, 256> productions;  // first production of stochastic rules
+    std::array<size_t, 256> production_lengths;
+    std::array<bool, 256> is_identity;    // symbol has no rule and rewrites to itself
+    std::array<bool, 256> is_stochastic;  // symbol has more than one production
+    std::array<std::vector<std::string>, 256> alternatives;  // productions of stochastic rules
+    std::array<std::vector<float>, 256> cumulative_weights;  // running sum of their weights
+    std::array<bool, 256> is_contextual;  // symbol has a production with a context
+    std::array<std::vector<ContextProduction>, 256> context_productions;  // every production of contextual symbols
+    std::array<std::string, 256> unchanged;  // the symbol itself, for contextual symbols no production applies to
+    std::array<bool, 256> is_context_ignored;
+    std::array<uint8_t, 256> parameter_counts;  // most parameters a module of the symbol has, parametric grammars only
+    bool parametric = false;
+    bool stochastic = false;
+    bool context_sensitive = false;
+    bool uses_left_context = false;
+    bool uses_right_context = false;
+};
+
+// Every generation of the last derived grammar, kept between regenerations.
+// Edits that leave the axiom and rules alone (angles, lengths, leaves) reuse
+// the cached string, and a deeper tree continues from the deepest cached generation.
+// The seed and the ignored context symbols only matter, and only invalidate
+// the cache, for stochastic and context-sensitive rules respectively.
+class LSystemDerivationCache {
+public:
+    // Stops between generations once `cancel` is set, the result is then not generation `depth`
+    const std::string& Expand(const LSystemGrammar& grammar,
+        const std::unordered_map<char, LSystemRule>& rules, int depth, const std::atomic<bool>* cancel = nullptr);
+
+    // Compiled programs kept on disk, consulted before deriving and filled after, see lsystem_cache.h
+    LSystemProgramCache* programs = nullptr;
+
+private:
+    std::string axiom;
+    std::unordered_map<char, LSystemRule> rules;
+    int seed = 0;
+    std::string contextIgnored;
+    std::vector<std::string> generations;
+};
+
+template <typename Visitor>
+bool LSystemGrammar::Derive(int depth, Visitor&& visit) const {
+    struct Frame {
+        const char* next;
+        const char* end;
+        int generation;
+    };
+
+    std::vector<Frame> stack;
+    stack.reserve(depth > 0 ? depth + 1 : 1);
+    stack.push_back({ axiom.data(), axiom.data() + axiom.size(), 0 });
+
+    // Position of the next symbol in every generation, the key of stochastic choices
+    std::vector<uint64_t> positions(stochastic ? (depth > 0 ? depth + 1 : 1) : 0, 0);
+
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        if (frame.next == frame.end) {
+            stack.pop_back();
+            continue;
+        }
+
+        const char c = *frame.next++;
+        const unsigned char symbol = static_cast<unsigned char>(c);
+        if (frame.generation >= depth || is_identity[symbol]) {
+            // Symbols without a rule are unchanged by every remaining generation
+            for (int generation = frame.generation; generation < static_cast<int>(positions.size()); generation++) {
+                positions[generation]++;
+            }
+            if (!visit(c)) return false;
+        }
+        else {
+            const std::string& production = stochastic
+                ? Successor(c, frame.generation, positions[frame.generation]++)
+                : productions[symbol];
+            stack.push_back({ production.data(), production.data() + production.size(), frame.generation + 1 });
+        }
+    }
+    return true;
+}
+
+// Turtle state as a similarity transform: translate(position) * rotate(rotation) * scale(scale).
+// Every turtle move is a rotation, a step or a uniform shrink, so 32 bytes
+// replace a 64-byte matrix and composing two frames costs about half a matrix product.
+struct TurtleFrame {
+    glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    glm::vec3 position = glm::vec3(0.0f);
+    float scale = 1.0f;
+
+    // this * other
+    TurtleFrame operator*(const TurtleFrame& other) const {
+        TurtleFrame result;
+        result.rotation = rotation * other.rotation;
+        result.position = position + scale * (rotation * other.position);
+        result.scale = scale * other.scale;
+        return result;
+    }
+
+    glm::mat4 ToMat4() const {
+        glm::mat4 matrix = glm::mat4_cast(rotation);
+        matrix[0] *= scale;
+        matrix[1] *= scale;
+        matrix[2] *= scale;
+        matrix[3] = glm::vec4(position, 1.0f);
+        return matrix;
+    }
+};
+
+enum class TurtleOpCode : uint32_t {
+    Nop,            // symbol without turtle meaning
+    Transform,      // multiply the turtle by a precomputed transform
+    Branch,         // emit a branch, the step that follows it is folded into the next Transform
+    ScaledBranch,   // emit a branch with its radius scaled by TurtleProgram::widths[operand], as Branch otherwise
+    Forward,        // emit a branch and step forward ('F' outside a compiled stream)
+    MaybeForward,   // randomly emit a branch and step forward ('X' and 'Y')
+    Leaf,           // emit a cluster of leaves
+    Push,           // save the turtle state
+    Pop             // restore the turtle state
+};
+
+// Transform kind of a symbol: '+' '-' roll, '&' '^' pitch, '/' '\\' yaw, -1 if it is no rotation
+constexpr int TurtleSymbolKind(char c) {
+    switch (c) {
+    case '+': return 0;
+    case '-': return 1;
+    case '&': return 2;
+    case '^': return 3;
+    case '/': return 4;
+    case '\\': return 5;
+    default: return -1;
+    }
+}
+
+// Instruction of a symbol that is not a rotation
+constexpr TurtleOpCode TurtleSymbolCode(char c) {
+    switch (c) {
+    case 'F': return TurtleOpCode::Forward;
+    case 'X':
+    case 'Y': return TurtleOpCode::MaybeForward;
+    case 'L': return TurtleOpCode::Leaf;
+    case '[': return TurtleOpCode::Push;
+    case ']': return TurtleOpCode::Pop;
+    default: return TurtleOpCode::Nop;
+    }
+}
+
+// One turtle instruction packed into 32 bits: 4 bits of opcode and 28 bits of
+// operand. The operand of a Transform is its index in TurtleProgram::transforms,
+// the operand of a Push is the distance to its matching Pop (0 if unknown).
+struct TurtleOp {
+    uint32_t bits;
+
+    TurtleOpCode Code() const { return static_cast<TurtleOpCode>(bits & 15u); }
+    uint32_t Transform() const { return bits >> 4; }
+    uint32_t Width() const { return bits >> 4; }
+    uint32_t PopDistance() const { return bits >> 4; }
+    static constexpr TurtleOp Make(TurtleOpCode code, uint32_t transform = 0) {
+        return { (transform << 4) | static_cast<uint32_t>(code) };
+    }
+};
+
+// Expanded L-system string compiled into turtle instructions. Every run of
+// rotations (and the step after a branch) is folded into one precomputed
+// frame, so interpretation is frame products with no trigonometry.
+// Identical runs share a matrix through a trie keyed by transform symbol.
+// Parametric modules override the global values: +(a) turns by a degrees and
+// F(l,w) steps l instead of the scale factor and scales the branch radius by w.
+class TurtleProgram {
+public:
+    /* constructor */
+    TurtleProgram(const LSystemParameters& params);
+
+    // Append the instructions for `symbols` to `ops`. False if the program needs
+    // more transforms or widths than an operand can index, `ops` is then incomplete
+    bool Compile(const std::string& symbols);
+    bool Compile(const LSystemModuleString& modules);
+    // Single instruction for one symbol, used when symbols are interpreted as they are derived
+    TurtleOp SymbolOp(char c) const { return symbol_ops[static_cast<unsigned char>(c)]; }
+    // Replace an empty program with one compiled at build time, see lsystem_presets.h
+    void Load(const LSystemPrecompiledProgram& precompiled);
+    // The reverse of Load: the ops and the trie as (parent, kind) nodes.
+    // False if the program holds literal frames of parametric modules
+    bool Export(std::vector<uint32_t>& opBits, std::vector<LSystemPrecompiledNode>& nodes) const;
+
+    static constexpr size_t MAX_OPERAND = size_t(1) << 28;
+    static constexpr size_t MAX_PUSH_DISTANCE = MAX_OPERAND;
+    static constexpr int TRANSFORM_KINDS = 7;  // + - & ^ / \ and the step after a branch
+    static constexpr int STEP_KIND = 6;
+
+    std::vector<TurtleOp> ops;
+    std::vector<TurtleFrame> transforms;  // [0] is the identity
+    std::vector<float> widths;            // radius scales of ScaledBranch instructions
+    TurtleFrame step;                     // move to the end of a branch and shrink the turtle
+
+private:
+    uint32_t FoldTransform(uint32_t run, int kind);
+    uint32_t AddTransform(const TurtleFrame& transform);
+    // Append an instruction whose operand indexes transforms or widths, false if the index does not fit
+    bool EmitIndexed(TurtleOpCode code, size_t index);
+    void LinkPush(size_t push, size_t close);
+    // Push, Pop and the instructions without operands
+    void EmitSymbol(unsigned char symbol, std::vector<size_t>& open_pushes);
+    // Transform of symbol kind `kind` with angle or step length `value`
+    TurtleFrame KindTransform(int kind, float value) const;
+
+    std::array<TurtleFrame, TRANSFORM_KINDS> kind_transforms;
+    std::array<int, 256> symbol_kinds;   // transform kind of a symbol or -1
+    std::array<TurtleOp, 256> symbol_ops;
+    std::vector<std::array<uint32_t, TRANSFORM_KINDS>> run_children;  // trie of folded runs, 0 = not created
+};
+
+// Copy of an instance group placed at `frame` relative to the group that holds it
+struct LSystemGroupInstance {
+    uint32_t group;
+    TurtleFrame frame;
+};
+
+// Geometry derived from one symbol with a fixed number of generations left,
+// relative to the turtle state where the symbol starts
+struct LSystemInstanceGroup {
+    std::vector<AffineInstance> branchTransforms;
+    std::vector<AffineInstance> leafTransforms;
+    std::vector<LSystemGroupInstance> children;
+    TurtleFrame exit;         // turtle state after the symbol, relative to its start
+    size_t branchCount = 0;   // instances once flattened, children included
+    size_t leafCount = 0;
+};
+
+// Tree as a DAG of instance groups. Repetitive grammars need one group per
+// (symbol, generations left) pair instead of one copy per occurrence.
+class LSystemInstanceGraph {
+public:
+    // Expand every group instance into world-space transforms. False if `cancel` was set
+    // before every group was written, the sinks then hold the part of the tree written so far
+    bool Flatten(const glm::mat4& model, InstanceSink& branchTransforms, InstanceSink& leafTransforms,
+        const std::atomic<bool>* cancel = nullptr) const;
+
+    std::vector<LSystemInstanceGroup> groups;
+    uint32_t root = 0;
+
+private:
+    // Write the group at `model` through the cursors, which advance past it
+    void FlattenGroup(uint32_t group, const glm::mat4& model, AffineInstance*& branches, AffineInstance*& leaves,
+        const std::atomic<bool>* cancel) const;
+};
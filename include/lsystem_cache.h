@@ -0,0 +1,76 @@
+#pragma once
+#include "lsystem.h"
+#include "lsystem_presets.h"
+#include "mapped_file.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Compiled turtle programs kept on disk between runs, keyed by a hash of the
+// grammar content and the depth. Reopening a species at a depth it was grown
+// at before loads its program straight from the mapped file, with no
+// derivation or compilation, as the built-in presets do, see lsystem_presets.h.
+//
+// Programs are independent of the angles and lengths, which only enter when
+// TurtleProgram::Load multiplies out the trie, so editing those keeps the
+// entry. The seed and the ignored context symbols are part of the key only
+// for stochastic and context-sensitive rules. Parametric grammars are not
+// cached: their modules carry values the program stores as literal frames.
+//
+// File layout, native byte order, every array 8-byte aligned:
+//   header   magic, version, entry count
+//   entries  sorted by (hash, depth), searched in place
+//   data     per entry its canonical grammar key, ops and trie nodes
+class LSystemProgramCache {
+public:
+    // Map the cache file at `path`. A missing file is an empty cache; a file
+    // of another version or a damaged header or entry table is ignored and
+    // rewritten by Save. Only the entry table is read, no program is touched
+    bool Open(const std::string& path);
+    // Program of the grammar at `depth`, valid until the next Save.
+    // Its grammar pointer is null, it is not a built-in preset.
+    // Only the program found is checked, a damaged one is a miss
+    bool Find(const LSystemGrammar& grammar, const std::unordered_map<char, LSystemRule>& rules, int depth,
+        LSystemPrecompiledProgram& program) const;
+    // Keep `program`, compiled from the grammar at `depth`, for the next Save
+    void Add(const LSystemGrammar& grammar, const std::unordered_map<char, LSystemRule>& rules, int depth,
+        const TurtleProgram& program);
+    // Write the mapped and the added programs back to the file and map it again
+    bool Save();
+
+    size_t Size() const { return entryCount + added.size(); }
+
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t MAX_PROGRAM_OPS = size_t(1) << 24;  // larger programs are cheaper to derive than to store
+
+private:
+    struct Entry {
+        uint64_t hash;
+        int64_t depth;
+        uint64_t keyOffset;
+        uint64_t keyLength;
+        uint64_t opOffset;
+        uint64_t opCount;
+        uint64_t nodeOffset;
+        uint64_t nodeCount;
+    };
+    struct AddedProgram {
+        uint64_t hash;
+        int depth;
+        std::string key;
+        std::vector<uint32_t> ops;
+        std::vector<LSystemPrecompiledNode> nodes;
+    };
+
+    // Everything the compiled program depends on, in a fixed order
+    static std::string Key(const LSystemGrammar& grammar, const std::unordered_map<char, LSystemRule>& rules);
+    static uint64_t Hash(const std::string& key);
+    const Entry* Entries() const;
+    bool Validate() const;
+
+    std::string path;
+    MappedFile file;
+    size_t entryCount = 0;
+    std::vector<AddedProgram> added;
+};
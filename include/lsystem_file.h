@@ -0,0 +1,36 @@
+#pragma once
+#include "lsystem.h"
+#include <string>
+#include <vector>
+
+// L-system species as text, one directive per line and '#' comments:
+//
+//   axiom X
+//   depth 4
+//   scale 0.75
+//   radius 15
+//   leaves 10 15               min and max leaves per cluster
+//   angles 30 73 20            x y z, in degrees
+//   seed 0
+//   leafbudget 0
+//   ignore +-&^/\              symbols skipped when matching context
+//   rule F -> F[/+FL][-FL]
+//   rule X -> F[-&XL] : 2      repeated rules are weighted alternatives
+//   rule S < A -> [&+FL]/S     left context, `A > B` for right context
+//   rule A(a,w) -> F(1,w)A(a*1.1,w*0.8)
+//
+// Whitespace inside a successor is ignored. Omitted directives keep the
+// values the parameters had before parsing.
+
+#define LSYSTEM_FILE_EXTENSION ".lsys"
+
+// Read `text` into `params`, replacing the axiom and rules. On failure
+// `params` is unchanged and `error` names the offending line
+bool ParseLSystemGrammar(const std::string& text, LSystemParameters& params, std::string& error);
+// `params` as text that ParseLSystemGrammar reads back
+std::string FormatLSystemGrammar(const LSystemParameters& params);
+
+bool LoadLSystemGrammar(const std::string& path, LSystemParameters& params);
+bool SaveLSystemGrammar(const std::string& path, const LSystemParameters& params);
+// Grammar files in `directory`, sorted by name
+std::vector<std::string> ListLSystemGrammars(const std::string& directory);
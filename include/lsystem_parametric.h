@@ -0,0 +1,149 @@
+#pragma once
+#include "lsystem.h"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Parametric modules such as F(1.5,0.2) packed into 32-bit words: a header
+// word holding the symbol and the parameter count, followed by the parameters
+// as floats. A module costs 4 bytes per value and no allocation.
+class LSystemModuleString {
+public:
+    static const int MAX_PARAMETERS = 8;
+
+    void Append(char symbol, const float* parameters, int count) {
+        words.push_back(Header(symbol, count));
+        for (int i = 0; i < count; i++) {
+            words.push_back(Word(parameters[i]));
+        }
+        modules++;
+    }
+    void Clear() {
+        words.clear();
+        modules = 0;
+    }
+
+    static uint32_t Header(char symbol, int count) {
+        return static_cast<uint32_t>(static_cast<unsigned char>(symbol)) | (static_cast<uint32_t>(count) << 8);
+    }
+    static char Symbol(uint32_t header) { return static_cast<char>(header & 0xFFu); }
+    static int Count(uint32_t header) { return static_cast<int>((header >> 8) & 0xFFu); }
+    static float Value(uint32_t word) {
+        float value;
+        std::memcpy(&value, &word, sizeof(value));
+        return value;
+    }
+    static uint32_t Word(float value) {
+        uint32_t word;
+        std::memcpy(&word, &value, sizeof(word));
+        return word;
+    }
+
+    std::vector<uint32_t> words;
+    size_t modules = 0;
+};
+
+enum class LSystemExpressionOp : uint32_t {
+    Constant,   // push the value
+    Parameter,  // push a parameter of the predecessor
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Power,
+    Negate
+};
+
+struct LSystemExpressionInstruction {
+    LSystemExpressionOp op;
+    uint32_t parameter;
+    float value;
+};
+
+// Parameter expression such as l*0.7 or (a+10)/2 compiled into stack bytecode.
+// Constant subexpressions are folded while compiling, so evaluation is a
+// short loop over a fixed array with no allocation.
+class LSystemExpression {
+public:
+    static const int MAX_STACK = 16;
+
+    // Compile `source`, which may refer to `names`, false on a syntax error
+    bool Compile(const std::string& source, const std::vector<std::string>& names, std::string& error);
+
+    float Evaluate(const float* parameters) const {
+        float stack[MAX_STACK];
+        int top = -1;
+        for (const LSystemExpressionInstruction& instruction : code) {
+            switch (instruction.op) {
+            case LSystemExpressionOp::Constant: stack[++top] = instruction.value; break;
+            case LSystemExpressionOp::Parameter: stack[++top] = parameters[instruction.parameter]; break;
+            case LSystemExpressionOp::Add: top--; stack[top] += stack[top + 1]; break;
+            case LSystemExpressionOp::Subtract: top--; stack[top] -= stack[top + 1]; break;
+            case LSystemExpressionOp::Multiply: top--; stack[top] *= stack[top + 1]; break;
+            case LSystemExpressionOp::Divide: top--; stack[top] /= stack[top + 1]; break;
+            case LSystemExpressionOp::Power: top--; stack[top] = Power(stack[top], stack[top + 1]); break;
+            case LSystemExpressionOp::Negate: stack[top] = -stack[top]; break;
+            }
+        }
+        return stack[0];
+    }
+
+private:
+    static float Power(float base, float exponent);
+
+    std::vector<LSystemExpressionInstruction> code;
+};
+
+// Rules over parametric modules, e.g. F(l,w) -> F(l*0.7,w*0.8)[+(25)F(l*0.5,w*0.6)].
+// A rule applies to modules with as many parameters as its formal parameters
+// (LSystemParameters::formalParameters). Rules without formal parameters apply
+// to every module of their symbol. A grammar with a module its symbol's rule
+// does not apply to is invalid: the skeleton cannot tell such a module apart.
+// Stochastic rules choose with the same key as LSystemGrammar, so the symbol
+// skeleton of the grammar derives the same choices and predicts the same sizes.
+class LSystemParametricGrammar {
+public:
+    /* constructor */
+    LSystemParametricGrammar(const LSystemParameters& params);
+
+    bool Valid() const { return error.empty(); }
+    const std::string& Error() const { return error; }
+
+    // Rewrite `current`, generation number `generation`, into `next`
+    void Rewrite(const LSystemModuleString& current, LSystemModuleString& next, int generation) const;
+    // Expand the axiom `depth` times. Stops between generations once `cancel` is set,
+    // the result is then not generation `depth`
+    LSystemModuleString Expand(int depth, const std::atomic<bool>* cancel = nullptr) const;
+
+    LSystemModuleString axiom;
+    int seed;
+
+private:
+    struct SuccessorModule {
+        char symbol;
+        uint32_t first_expression;
+        uint32_t count;
+    };
+    struct Production {
+        std::vector<SuccessorModule> modules;
+        std::vector<LSystemExpression> expressions;
+        size_t words = 0;  // exact size of the production once packed
+    };
+    struct Rule {
+        int arity = -1;  // -1 when the symbol has no rule
+        std::vector<Production> productions;
+        std::vector<float> cumulative_weights;
+
+        bool Applies(int count) const { return arity == count || arity == 0; }
+    };
+
+    bool Parse(const std::string& source, const std::vector<std::string>& names, Production& production);
+    // False, with an error naming `where`, if the rule of a module's symbol does not apply to it
+    bool CheckArity(const Production& production, const std::string& where);
+    const Production& Choose(const Rule& rule, int generation, uint64_t index) const;
+
+    std::array<Rule, 256> rules;
+    std::string error;
+};
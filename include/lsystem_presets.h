@@ -0,0 +1,243 @@
+#pragma once
+#include "lsystem.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// Built-in L-system grammars as constant data. The editor presets are built
+// from these, and lsystem_presets.cpp expands and compiles them to turtle
+// programs while the project builds, so choosing an unmodified preset skips
+// derivation and compilation entirely.
+
+struct LSystemPresetRule {
+    char symbol;
+    const char* successor;
+};
+
+struct LSystemPresetGrammar {
+    const char* axiom;
+    const LSystemPresetRule* rules;
+    size_t ruleCount;
+
+    // Rules in the form used by LSystemParameters
+    std::unordered_map<char, LSystemRule> Rules() const;
+};
+
+constexpr LSystemPresetRule L_SYS_RULES_DEFAULT[] = {
+    { 'X', "F[//+XXL][+++YXL][-&^FXL][&FXL][\\^FXL][--^FXL][^&X]" },
+    { 'F', "F[/+FL][-FL]" },
+    { 'Y', "F[\\+&FYL][/-+F^YL][/&F^Y*L][\\^FYL][F++++YL]" },
+    { 'L', "L[+L][-L][&L][^L]" }
+};
+constexpr LSystemPresetRule L_SYS_RULES_PLANT[] = {
+    { 'X', "F[//+XXL][+++YXL][-&^FXL]" },
+    { 'F', "F[/+FL][-FL]" },
+    { 'Y', "F[\\+&FYL][/-+F^YL]" },
+    { 'L', "L[+L][-L]" }
+};
+constexpr LSystemPresetRule L_SYS_RULES_AUTUMN[] = {
+    { 'X', "F[//+XXL][&XL][\\^XL]" },
+    { 'F', "F[F/+L][-FL]" },
+    { 'Y', "[/&^Y*L][\\^YL][++++YL]" }
+};
+
+constexpr LSystemPresetGrammar L_SYS_GRAMMAR_DEFAULT = { "X", L_SYS_RULES_DEFAULT, 4 };
+constexpr LSystemPresetGrammar L_SYS_GRAMMAR_PLANT = { "X", L_SYS_RULES_PLANT, 4 };
+constexpr LSystemPresetGrammar L_SYS_GRAMMAR_AUTUMN = { "X", L_SYS_RULES_AUTUMN, 3 };
+
+// Trie node of a precompiled program: transforms[i] = transforms[parent] * (transform of kind)
+struct LSystemPrecompiledNode {
+    uint32_t parent;
+    uint32_t kind;
+};
+
+// Turtle program of a preset grammar at a fixed depth, see TurtleProgram::Load
+struct LSystemPrecompiledProgram {
+    const LSystemPresetGrammar* grammar;
+    int depth;
+    const uint32_t* ops;
+    size_t opCount;
+    const LSystemPrecompiledNode* nodes;
+    size_t nodeCount;
+};
+
+// Precompiled program for `params`, or nullptr unless they hold a built-in
+// grammar, unedited, at one of the precompiled depths
+const LSystemPrecompiledProgram* FindPrecompiledLSystem(const LSystemParameters& params);
+
+// Compile-time expansion. Everything below runs inside the compiler; the
+// deepest preset needs a larger constexpr step budget than MSVC's default,
+// see /constexpr:steps in the project file.
+
+#define LSYSTEM_PRESET_MAX_DEPTH 8
+
+constexpr size_t LSystemPresetLength(const char* symbols) {
+    size_t length = 0;
+    while (symbols[length] != '\0') length++;
+    return length;
+}
+
+constexpr const char* LSystemPresetSuccessor(const LSystemPresetGrammar& grammar, char c) {
+    for (size_t i = 0; i < grammar.ruleCount; i++) {
+        if (grammar.rules[i].symbol == c) return grammar.rules[i].successor;
+    }
+    return nullptr;
+}
+
+// Length of the grammar expanded `depth` times
+constexpr size_t LSystemPresetExpandedLength(const LSystemPresetGrammar& grammar, int depth) {
+    size_t counts[256] = {};
+    for (const char* c = grammar.axiom; *c != '\0'; c++) {
+        counts[static_cast<unsigned char>(*c)]++;
+    }
+    for (int generation = 0; generation < depth; generation++) {
+        size_t next[256] = {};
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (counts[symbol] == 0) continue;
+            const char* successor = LSystemPresetSuccessor(grammar, static_cast<char>(symbol));
+            if (successor == nullptr) {
+                next[symbol] += counts[symbol];
+                continue;
+            }
+            for (const char* c = successor; *c != '\0'; c++) {
+                next[static_cast<unsigned char>(*c)] += counts[symbol];
+            }
+        }
+        for (int symbol = 0; symbol < 256; symbol++) {
+            counts[symbol] = next[symbol];
+        }
+    }
+    size_t length = 0;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        length += counts[symbol];
+    }
+    return length;
+}
+
+template <size_t OpCount, size_t NodeCount>
+struct LSystemPresetProgram {
+    uint32_t ops[OpCount > 0 ? OpCount : 1] = {};
+    LSystemPrecompiledNode nodes[NodeCount] = {};
+    size_t opCount = 0;
+    size_t nodeCount = 0;
+};
+
+// TurtleProgram::Compile over the expanded grammar, with the trie stored as
+// (parent, kind) pairs since frames need the runtime angles. Node numbering
+// and instructions are identical to a runtime compile of Expand(depth).
+// Capacities must hold the whole program, otherwise compilation fails.
+template <size_t OpCapacity, size_t NodeCapacity>
+class LSystemPresetCompiler {
+public:
+    constexpr LSystemPresetProgram<OpCapacity, NodeCapacity> Compile(const LSystemPresetGrammar& grammar, int depth) {
+        // Identity and the single rotations, in the order of the TurtleProgram constructor
+        program.nodeCount = 1;
+        for (int kind = 0; kind < 6; kind++) {
+            FoldTransform(0, kind);
+        }
+
+        const char* successors[256] = {};
+        for (size_t i = 0; i < grammar.ruleCount; i++) {
+            successors[static_cast<unsigned char>(grammar.rules[i].symbol)] = grammar.rules[i].successor;
+        }
+
+        // Depth-first derivation: a symbol is rewritten until it has no rule or no generations left
+        const char* stack[LSYSTEM_PRESET_MAX_DEPTH + 1] = {};
+        int top = 0;
+        stack[0] = grammar.axiom;
+        while (top >= 0) {
+            if (*stack[top] == '\0') {
+                top--;
+                continue;
+            }
+            const char c = *stack[top]++;
+            const char* successor = successors[static_cast<unsigned char>(c)];
+            if (top < depth && successor != nullptr) {
+                stack[++top] = successor;
+                continue;
+            }
+            CompileSymbol(c);
+        }
+
+        // Pushes that are never popped span the rest of the program
+        for (size_t i = 0; i < open_count; i++) {
+            LinkPush(open_pushes[i], program.opCount);
+        }
+        return program;
+    }
+
+private:
+    constexpr void CompileSymbol(char c) {
+        const int kind = TurtleSymbolKind(c);
+        if (kind >= 0) {
+            run = FoldTransform(run, kind);
+            return;
+        }
+        const TurtleOpCode code = TurtleSymbolCode(c);
+        if (code == TurtleOpCode::Nop) return;
+
+        if (run != 0) {
+            Emit(TurtleOp::Make(TurtleOpCode::Transform, run));
+            run = 0;
+        }
+        if (code == TurtleOpCode::Forward) {
+            Emit(TurtleOp::Make(TurtleOpCode::Branch));
+            run = FoldTransform(0, TurtleProgram::STEP_KIND);
+            return;
+        }
+        if (code == TurtleOpCode::Push) {
+            open_pushes[open_count++] = program.opCount;
+        }
+        else if (code == TurtleOpCode::Pop && open_count > 0) {
+            open_count--;
+            LinkPush(open_pushes[open_count], program.opCount);
+        }
+        Emit(TurtleOp::Make(code));
+    }
+
+    constexpr uint32_t FoldTransform(uint32_t parent, int kind) {
+        uint32_t child = children[parent][kind];
+        if (child == 0) {
+            child = static_cast<uint32_t>(program.nodeCount++);
+            program.nodes[child] = { parent, static_cast<uint32_t>(kind) };
+            children[parent][kind] = child;
+        }
+        return child;
+    }
+
+    constexpr void Emit(TurtleOp op) {
+        program.ops[program.opCount++] = op.bits;
+    }
+
+    constexpr void LinkPush(size_t push, size_t close) {
+        const size_t distance = close - push;
+        if (distance < TurtleProgram::MAX_PUSH_DISTANCE) {
+            program.ops[push] = TurtleOp::Make(TurtleOpCode::Push, static_cast<uint32_t>(distance)).bits;
+        }
+    }
+
+    LSystemPresetProgram<OpCapacity, NodeCapacity> program;
+    uint32_t children[NodeCapacity][TurtleProgram::TRANSFORM_KINDS] = {};
+    size_t open_pushes[OpCapacity > 0 ? OpCapacity : 1] = {};
+    size_t open_count = 0;
+    uint32_t run = 0;  // transform folded so far, 0 while nothing is pending
+};
+
+// Exact sizes of a preset program, found by compiling once into scratch
+// capacity: an instruction per symbol plus the step after each branch
+struct LSystemPresetSize {
+    size_t ops;
+    size_t nodes;
+};
+
+template <size_t Length>
+constexpr LSystemPresetSize MeasureLSystemPreset(const LSystemPresetGrammar& grammar, int depth) {
+    const auto program = LSystemPresetCompiler<2 * Length, Length + 7>().Compile(grammar, depth);
+    return { program.opCount, program.nodeCount };
+}
+
+template <size_t OpCount, size_t NodeCount>
+constexpr LSystemPresetProgram<OpCount, NodeCount> CompileLSystemPreset(const LSystemPresetGrammar& grammar, int depth) {
+    return LSystemPresetCompiler<OpCount, NodeCount>().Compile(grammar, depth);
+}
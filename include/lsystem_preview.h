@@ -0,0 +1,60 @@
+#pragma once
+#include "affine_instance.h"
+#include "lsystem.h"
+#include "tree.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Tree of one depth of a progressive preview
+struct LSystemPreviewLevel {
+    int depth = 0;
+    std::vector<AffineInstance> branchTransforms;
+    std::vector<AffineInstance> leafTransforms;
+};
+
+// Grows an L-system tree on a background thread at depth 1, 2, ... up to the
+// requested depth, so a coarse tree is on screen after the fastest level
+// instead of after the deepest. Every level continues the derivation of the
+// one before through the worker's own LSystemDerivationCache; for a grammar
+// that grows g times per generation the shallower levels add about 1 / (g - 1)
+// of the deepest level's cost.
+// A new Start drops the tree still growing: the level in flight stops at the
+// next generation or block of instructions and is discarded, no later level
+// of it is grown.
+class LSystemPreview {
+public:
+    LSystemPreview() = default;
+    ~LSystemPreview();
+    LSystemPreview(const LSystemPreview&) = delete;
+    LSystemPreview& operator=(const LSystemPreview&) = delete;
+
+    // Grow one tree per placement with `params`, a single placement without
+    // the forest path, as Tree::createBranchesLSystem would
+    void Start(const LSystemParameters& params, const std::vector<ForestPlacement>& placements);
+    // Drop the tree still growing and any level not polled yet
+    void Cancel();
+    // Deepest level finished since the last call, false if there is none
+    bool Poll(LSystemPreviewLevel& level);
+    // Levels of the current tree are still growing
+    bool Busy() const { return busy; }
+
+private:
+    void Run();
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<uint64_t> job{ 0 };  // changed by every Start and Cancel, levels of older jobs are dropped
+    std::atomic<bool> cancelled{ false };  // set with every job change, stops the level in flight
+    std::atomic<bool> busy{ false };
+    bool pending = false;
+    bool stopping = false;
+    LSystemParameters params = {};
+    std::vector<ForestPlacement> placements;
+    LSystemPreviewLevel finished;
+    bool hasFinished = false;
+};
@@ -1,7 +1,11 @@
 #pragma once
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
 #include <vector>
+#include "affine_instance.h"
+#include "instance_sink.h"
+#include "shader.h"
 
 class MeshRenderer {
 public:
@@ -10,12 +14,67 @@ public:
         unsigned int VBO;
         unsigned int EBO;
         size_t indexCount;
+        unsigned int instanceVBO;      // transforms of the instances, see uploadInstances
+        size_t instanceCount;
+        bool quantized;                // instances are stored as PackedAffineInstance
+        AffineInstance* instanceMap;   // persistent mapping of instanceVBO, or nullptr
+        size_t instanceCapacity;       // instances instanceMap has room for
+        GLsync instanceFence;          // signalled once the last draw from instanceMap is done, or nullptr
 
-        BufferObjects() : VAO(0), VBO(0), EBO(0), indexCount(0) {}
+        BufferObjects() : VAO(0), VBO(0), EBO(0), indexCount(0), instanceVBO(0), instanceCount(0), quantized(false),
+            instanceMap(nullptr), instanceCapacity(0), instanceFence(nullptr) {}
+    };
+
+    // Sink that writes instances straight into the instance buffer of a mesh,
+    // skipping the host copy. The buffer is mapped persistently when the driver
+    // has ARB_buffer_storage, and kept mapped for the next sink on the mesh;
+    // otherwise it is mapped with glMapBufferRange for the sink's lifetime.
+    // If the driver refuses the mapping, the instances are kept on the host and
+    // uploaded when the sink is finished.
+    // The mesh's instances are replaced, and drawable once the sink is finished.
+    class MappedInstanceSink : public InstanceSink {
+    public:
+        explicit MappedInstanceSink(BufferObjects& buffers);
+        ~MappedInstanceSink() override;
+
+        void reserve(size_t count) override;
+        AffineInstance* extend(size_t count) override;
+        size_t size() const override { return count; }
+        void truncate(size_t kept) override { count = std::min(count, kept); }
+
+        // Unmap if needed and hand the instances to the mesh, called by the destructor
+        void finish();
+
+    private:
+        void grow(size_t capacity);
+
+        BufferObjects& buffers;
+        AffineInstance* mapped = nullptr;
+        std::vector<AffineInstance> hostInstances; // instances when the buffer could not be mapped
+        bool onHost = false;
+        size_t count = 0;
+        size_t capacity = 0;
+        bool persistent = false;
+        bool finished = false;
     };
 
     static BufferObjects createBuffers(const std::vector<float>& vertices,
         const std::vector<unsigned int>& indices);
 
+    // Replace the vertices and indices of a mesh, keeping its VAO and instance
+    // buffer, and its persistent mapping, for the next sink. The mesh draws no
+    // instances until new ones are written. Creates the buffers if there are none
+    static void setMesh(BufferObjects& buffers, const std::vector<float>& vertices,
+        const std::vector<unsigned int>& indices);
+
+    // Replace the instances drawn by drawInstances. With `quantized` they are
+    // packed to PackedAffineInstance first, 32 bytes each instead of 48.
+    static void uploadInstances(BufferObjects& buffers, const std::vector<AffineInstance>& instances,
+        bool quantized = false);
+
+    // Draw the mesh once per uploaded instance in a single call. A persistently
+    // mapped instance buffer is fenced, so the next sink waits for this draw only
+    static void drawInstances(BufferObjects& buffers, const Shader& shader);
+
     static void deleteBuffers(BufferObjects& buffers);
-};
\ No newline at end of file
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for scratch memory that lives for one step of an algorithm.
+// Allocate hands out uninitialized arrays from large blocks; Reset releases
+// all of them at once. Reset folds the blocks a step needed into one, so once
+// the arena has grown to the size of a step, allocating is a pointer bump.
+// Only for trivially destructible types, nothing is ever destroyed.
+class ScratchArena {
+public:
+    ScratchArena() = default;
+    // Copies start empty, the contents only matter within a step
+    ScratchArena(const ScratchArena&) {}
+    ScratchArena& operator=(const ScratchArena&) { return *this; }
+    ScratchArena(ScratchArena&&) = default;
+    ScratchArena& operator=(ScratchArena&&) = default;
+
+    template <typename T>
+    T* Allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destroyed");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "blocks are only aligned for fundamental types");
+        const size_t bytes = count * sizeof(T);
+        for (;;) {
+            if (current < blocks.size()) {
+                const size_t offset = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+                if (offset + bytes <= blocks[current].size) {
+                    used = offset + bytes;
+                    return reinterpret_cast<T*>(blocks[current].data.get() + offset);
+                }
+                if (current + 1 < blocks.size()) {
+                    current++;
+                    used = 0;
+                    continue;
+                }
+            }
+            // Geometric growth keeps the number of blocks per step logarithmic
+            const size_t last = blocks.empty() ? 0 : blocks.back().size;
+            AddBlock(std::max({ MIN_BLOCK_SIZE, 2 * last, bytes }));
+            current = blocks.size() - 1;
+            used = 0;
+        }
+    }
+
+    void Reset() {
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (const Block& block : blocks) {
+                total += block.size;
+            }
+            blocks.clear();
+            AddBlock(total);
+        }
+        current = 0;
+        used = 0;
+    }
+
+    static constexpr size_t MIN_BLOCK_SIZE = 64 * 1024;
+
+private:
+    struct Block {
+        std::unique_ptr<unsigned char[]> data;
+        size_t size;
+    };
+
+    void AddBlock(size_t size) {
+        blocks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[size]), size });
+    }
+
+    std::vector<Block> blocks;
+    size_t current = 0;  // block allocations come from
+    size_t used = 0;     // bytes of it handed out
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// Uniform grid over a set of points for fixed-radius neighbour queries.
+// Built by a counting sort: points are counted per cell, the counts are
+// prefix-summed into cell start offsets and the point indices (and a copy of
+// their coordinates, one array per axis) are scattered in cell order.
+// Cells are dense over the bounding box and indexed by signed, floored
+// coordinates, so points on either side of an axis never share a cell.
+// Rebuilding reuses the arrays, a build is two linear passes and no allocation
+// once they have grown.
+class SpatialGrid {
+public:
+    // Index the `count` points with coordinates x[i], y[i], z[i] with cells at least
+    // `cell_size` wide. Cells grow when the bounding box would need more than a few
+    // cells per point
+    void Build(const float* x, const float* y, const float* z, size_t count, float cell_size);
+
+    // Call visit(index, position) for every point in the 3x3x3 cells around
+    // `position`, a superset of the points within CellSize() of it
+    template <typename Visitor>
+    void ForEachNear(const glm::vec3& position, Visitor&& visit) const;
+
+    // Closest point to `position` in the same 3x3x3 cells, exact for points
+    // within CellSize(). Tests 8 points per instruction with AVX2, 4 with SSE2;
+    // ties go to the point the grid lists first, as a ForEachNear scan would.
+    // False if those cells are empty
+    bool FindNearest(const glm::vec3& position, uint32_t& index, float& distance_sq) const;
+
+    float CellSize() const { return cell_size; }
+    size_t Size() const { return indices.size(); }
+
+private:
+    glm::ivec3 Cell(const glm::vec3& position) const {
+        return glm::ivec3(glm::floor(position * inverse_cell_size));
+    }
+
+    float cell_size = 1.0f;
+    float inverse_cell_size = 1.0f;
+    glm::ivec3 origin = glm::ivec3(0);      // lowest cell of the bounding box
+    glm::ivec3 dimensions = glm::ivec3(0);  // cells per axis
+    std::vector<uint32_t> cell_starts;      // first entry of every cell, plus the end
+    std::vector<uint32_t> indices;          // point indices in cell order
+    std::vector<float> xs;                  // their coordinates, so a query reads three arrays,
+    std::vector<float> ys;                  // padded for a full vector load at the end
+    std::vector<float> zs;
+    std::vector<uint32_t> point_cells;      // cell of every point, scratch of Build
+};
+
+template <typename Visitor>
+void SpatialGrid::ForEachNear(const glm::vec3& position, Visitor&& visit) const {
+    if (indices.empty()) return;
+
+    const glm::ivec3 low = glm::max(Cell(position) - 1 - origin, glm::ivec3(0));
+    const glm::ivec3 high = glm::min(Cell(position) + 1 - origin, dimensions - 1);
+    if (glm::any(glm::greaterThan(low, high))) return;  // too far outside the grid
+    for (int z = low.z; z <= high.z; z++) {
+        for (int y = low.y; y <= high.y; y++) {
+            // Cells along x are adjacent, so a row is one contiguous range
+            const size_t row = (static_cast<size_t>(z) * dimensions.y + y) * dimensions.x;
+            const uint32_t end = cell_starts[row + high.x + 1];
+            for (uint32_t entry = cell_starts[row + low.x]; entry < end; entry++) {
+                visit(indices[entry], glm::vec3(xs[entry], ys[entry], zs[entry]));
+            }
+        }
+    }
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <vector>
 #include <glm.hpp>
 #include <string>
@@ -7,18 +8,49 @@
 #include "tree_nodes.h"
 #include "common_types.h"
 #include "cylinder.h"
+#include "lsystem.h"
+
+// Where a tree of a forest stands and the seed of its random draws
+struct ForestPlacement {
+    glm::mat4 root;
+    int seed;
+};
+
+// Instances of a whole forest, ready for one instanced upload. Tree i owns
+// branchTransforms[branchOffsets[i], branchOffsets[i + 1]) and likewise for leaves.
+struct ForestInstances {
+    std::vector<AffineInstance> branchTransforms;
+    std::vector<AffineInstance> leafTransforms;
+    std::vector<size_t> branchOffsets;  // one entry per tree plus the end
+    std::vector<size_t> leafOffsets;
+};
 
 class Tree {
 public:
-    static void createBranches(glm::mat4& model, std::vector<glm::mat4>& branchTransforms,
+    static void createBranches(glm::mat4& model, std::vector<AffineInstance>& branchTransforms,
         float length, float radius, int depth);
 
-    static void createBranchesLSystem(glm::mat4& model, std::vector<glm::mat4>& branchTransforms,
-        std::vector<glm::mat4>& leafTransforms, const std::string& axiom,
-        const std::unordered_map<char, std::string>& rules,
-        float length, float radius, int depth, int maxLeafCount, int minLeafCount, float xAngle, float yAngle, float zAngle);
+    // Returns the depth actually derived, which the instance and memory budgets may clamp.
+    // The transforms are appended to the sinks, leaves and the branches of long programs
+    // in one block each that is filled in place.
+    // Setting `cancel` from another thread stops the derivation between generations, the
+    // interpretation between blocks of instructions and the leaves between clusters;
+    // 0 is returned and the sinks hold part of the tree
+    static int createBranchesLSystem(glm::mat4& model, InstanceSink& branchTransforms,
+        InstanceSink& leafTransforms, const LSystemParameters& params,
+        LSystemDerivationCache* cache = nullptr, const std::atomic<bool>* cancel = nullptr);
+
+    // Grow one L-system tree per placement from a shared derivation, trees in parallel.
+    // The budgets of `params` cover the whole forest. Subtree instancing and streamed
+    // derivation apply to single trees only. Returns the derived depth, 0 on an invalid grammar
+    // or once `cancel` stopped it, as for createBranchesLSystem
+    static int createForestLSystem(const std::vector<ForestPlacement>& placements, const LSystemParameters& params,
+        ForestInstances& forest, LSystemDerivationCache* cache = nullptr, const std::atomic<bool>* cancel = nullptr);
+
+    // Derive the tree as shared subtree groups, false if the grammar's brackets are unbalanced
+    static bool createLSystemInstanceGraph(const LSystemParameters& params, LSystemInstanceGraph& graph);
 
-    static void createBranchesSpaceColonization(std::vector<TreeNode>& tree_nodes, glm::mat4& model, 
-        std::vector<glm::mat4>& branchTransforms, std::vector<glm::mat4>& leafTransforms,
+    static void createBranchesSpaceColonization(const TreeNodeManager& tree_nodes, glm::mat4& model, 
+        InstanceSink& branchTransforms, InstanceSink& leafTransforms,
         float radius, int depth, int root_nodes);
 };
\ No newline at end of file
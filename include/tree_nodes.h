@@ -1,18 +1,36 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <cstdint>
 #include <vector>
 #include "common_types.h"
+#include "scratch_arena.h"
 
 
+// Tree nodes as parallel arrays indexed by node, 28 bytes a node. Children
+// form a singly linked list through first_children and next_siblings, the
+// newest child first. The first initial_num nodes are the root branch, linked
+// by their order rather than as parent and child
 class TreeNodeManager {
 public:
 	/* constructor */
 	TreeNodeManager(int initial_num);
 
-	bool GrowNewNodes(float growth_distance);
-	void DebugPrintNodes();
-	std::vector<TreeNode> tree_nodes;
+	// Grow a child from every node towards the attraction points linked to it
+	bool GrowNewNodes(float growth_distance, const AttractionPointStore& attraction_points, const NodePointLinks& links);
+	void DebugPrintNodes(const AttractionPointStore& attraction_points, const NodePointLinks& links);
+
+	size_t Size() const { return positions.size(); }
+	// Append a node as the first child of `parent`, -1 for none, and return its index
+	size_t AddNode(const glm::vec3& position, int32_t parent, float radius);
+
+	std::vector<glm::vec3> positions;
+	std::vector<int32_t> parents;         // -1 for the root branch
+	std::vector<float> radii;
+	std::vector<int32_t> first_children;  // -1 if none
+	std::vector<int32_t> next_siblings;   // -1 for the last child
 private:
 	void InitializeTreeNodes(int initial_num);
-	glm::vec3 GrowthDirection(TreeNode& node);
+	glm::vec3 GrowthDirection(size_t node, const AttractionPointStore& attraction_points, const NodePointLinks& links);
+
+	ScratchArena scratch;  // per GrowNewNodes call
 };
@@ -2,15 +2,35 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 
-uniform mat4 model;
+// Per-instance transform, see MeshRenderer::uploadInstances. Either the three
+// rows of an AffineInstance, or a PackedAffineInstance: nine half floats of
+// the rotation-scale block spread over the first three attributes, and the
+// translation in the fourth.
+layout (location = 2) in vec4 aInstance0;
+layout (location = 3) in vec4 aInstance1;
+layout (location = 4) in vec4 aInstance2;
+layout (location = 5) in vec3 aInstanceTranslation;
+
+uniform bool quantizedInstances;
 uniform mat4 view;
 uniform mat4 projection;
 
 out vec3 Normal;
 out vec3 FragPos;
 
+mat4 instanceModel() {
+    if (quantizedInstances) {
+        return mat4(vec4(aInstance0.x, aInstance0.w, aInstance1.z, 0.0),
+                    vec4(aInstance0.y, aInstance1.x, aInstance1.w, 0.0),
+                    vec4(aInstance0.z, aInstance1.y, aInstance2.x, 0.0),
+                    vec4(aInstanceTranslation, 1.0));
+    }
+    return transpose(mat4(aInstance0, aInstance1, aInstance2, vec4(0.0, 0.0, 0.0, 1.0)));
+}
+
 void main() {
+    mat4 model = instanceModel();
     FragPos = vec3(model * vec4(aPos, 1.0));
     Normal = mat3(transpose(inverse(model))) * aNormal;
     gl_Position = projection * view * model * vec4(aPos, 1.0);
-}
\ No newline at end of file
+}
@@ -2,7 +2,12 @@
 #include "tree_nodes.h"
 #include "common_types.h"
 #include <iostream>
+#include <algorithm>
+#include <limits>
 #include <random>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 AttractionPointManager::AttractionPointManager(Envelope envelope) {
     this->envelope = envelope;
@@ -24,8 +29,6 @@ void AttractionPointManager::EvenlyDistribute() {
     for (int x = -envelope.negative_x; x <= envelope.positive_x; x++) {
         for (int y = 0; y <= envelope.positive_y; y++) {
             for (int z = -envelope.negative_z; z <= envelope.positive_z; z++) {
-                AttractionPoint point;
-
                 // Calculate base position
                 glm::vec3 basePosition(
                     envelope.position.x + envelope.interval.x * x,
@@ -41,10 +44,7 @@ void AttractionPointManager::EvenlyDistribute() {
                 );
 
                 // Final position combines base position with scaled random offset
-                point.position = basePosition + randomOffset;
-
-                point.reached = false;
-                attraction_points.push_back(point);
+                attraction_points.Add(basePosition + randomOffset);
             }
         }
     }
@@ -56,102 +56,312 @@ void AttractionPointManager::CreatePoints() {
     }
 }
 
-void AttractionPointManager::UpdateLinks(TreeNodeManager& tree_node_manager, const float influence_radius, const float min_distance) {
+// Flags of a point during an update, cleared at its end
+#define POINT_CANDIDATE 1
+#define POINT_REACHED_NOW 2
+
+void AttractionPointManager::UpdateLinks(TreeNodeManager& tree_node_manager, const float influence_radius, const float min_distance,
+    bool incremental) {
+    if (incremental) {
+        UpdateLinksIncremental(tree_node_manager, influence_radius, min_distance);
+        return;
+    }
+    // The next incremental update starts over
+    linked_node_count = 0;
+
     const float influence_radius_sq = influence_radius * influence_radius;
     const float min_distance_sq = min_distance * min_distance;
-    
-    for (auto& node : tree_node_manager.tree_nodes) {
-        node.linked_points.clear();
+    const size_t point_count = attraction_points.Size();
+    point_flags.resize(point_count, 0);
+
+    // Nodes within the influence radius of a point lie in the 27 cells around it
+    const size_t node_count = tree_node_manager.Size();
+    node_x.resize(node_count);
+    node_y.resize(node_count);
+    node_z.resize(node_count);
+    for (size_t i = 0; i < node_count; i++) {
+        node_x[i] = tree_node_manager.positions[i].x;
+        node_y[i] = tree_node_manager.positions[i].y;
+        node_z[i] = tree_node_manager.positions[i].z;
     }
+    node_grid.Build(node_x.data(), node_y.data(), node_z.data(), node_count, influence_radius);
 
-    struct GridCell {
-        std::vector<size_t> node_indices;
-    };
+    #pragma omp parallel for if(point_count > 1000)
+    for (long long p = 0; p < static_cast<long long>(point_count); p++) {
+        if (attraction_points.Reached(p)) continue;
 
-    const float cell_size = influence_radius;
-    std::unordered_map<size_t, GridCell> grid;
-
-    for (size_t i = 0; i < tree_node_manager.tree_nodes.size(); i++) {
-        const auto& node = tree_node_manager.tree_nodes[i];
-        size_t cell_x = static_cast<size_t>(node.position.x / cell_size);
-        size_t cell_y = static_cast<size_t>(node.position.y / cell_size);
-        size_t cell_z = static_cast<size_t>(node.position.z / cell_size);
-        size_t cell_key = (cell_x << 20) | (cell_y << 10) | cell_z;
-        grid[cell_key].node_indices.push_back(i);
-    }
-
-    #pragma omp parallel for if(attraction_points.size() > 1000)
-    for (size_t p = 0; p < attraction_points.size(); p++) {
-        auto& point = attraction_points[p];
-        if (point.reached) continue;
-
-        point.linked_node = -1;
-        float closest_distance_sq = std::numeric_limits<float>::max();
-        size_t closest_node = -1;
-
-        // Check only neighboring cells
-        size_t cell_x = static_cast<size_t>(point.position.x / cell_size);
-        size_t cell_y = static_cast<size_t>(point.position.y / cell_size);
-        size_t cell_z = static_cast<size_t>(point.position.z / cell_size);
-
-        for (int dx = -1; dx <= 1; dx++) {
-            for (int dy = -1; dy <= 1; dy++) {
-                for (int dz = -1; dz <= 1; dz++) {
-                    size_t cell_key = ((cell_x + dx) << 20) | ((cell_y + dy) << 10) | (cell_z + dz);
-                    auto it = grid.find(cell_key);
-                    if (it == grid.end()) continue;
-
-                    // Check nodes in this cell
-                    for (size_t node_idx : it->second.node_indices) {
-                        const auto& node = tree_node_manager.tree_nodes[node_idx];
-                        const glm::vec3 diff = point.position - node.position;
-                        const float distance_sq = glm::dot(diff, diff);
-
-                        if (distance_sq <= influence_radius_sq && distance_sq < closest_distance_sq) {
-                            closest_distance_sq = distance_sq;
-                            closest_node = node_idx;
-                        }
-                        if (distance_sq <= min_distance_sq) {
-                            point.reached = true;
-                            break;
-                        }
-                    }
-                }
-            }
+        // The closest node decides both the link and whether the point is reached
+        attraction_points.linked_node[p] = -1;
+        uint32_t closest_node;
+        float closest_distance_sq;
+        if (!node_grid.FindNearest(attraction_points.Position(p), closest_node, closest_distance_sq)) continue;
+
+        if (closest_distance_sq <= influence_radius_sq) {
+            attraction_points.linked_node[p] = static_cast<int32_t>(closest_node);
+        }
+        if (closest_distance_sq <= min_distance_sq) {
+            point_flags[p] |= POINT_REACHED_NOW;
+        }
+    }
+    MarkReachedNow();
+
+    BuildLinks(node_count);
+    std::fill(point_flags.begin(), point_flags.end(), 0);
+}
+
+void AttractionPointManager::UpdateLinksIncremental(TreeNodeManager& tree_node_manager, const float influence_radius, const float min_distance) {
+    const float influence_radius_sq = influence_radius * influence_radius;
+    const float min_distance_sq = min_distance * min_distance;
+    const size_t point_count = attraction_points.Size();
+    const size_t node_count = tree_node_manager.Size();
+
+    // Start over for a new tree, a new radius or after a full update
+    if (linked_node_count > node_count || influence_radius != linked_radius ||
+        closest_distances.size() != point_count) {
+        linked_node_count = 0;
+    }
+    if (linked_node_count == 0) {
+        for (size_t p = 0; p < point_count; p++) {
+            if (!attraction_points.Reached(p)) attraction_points.linked_node[p] = -1;
         }
+        point_grid.Build(attraction_points.x.data(), attraction_points.y.data(), attraction_points.z.data(), point_count, influence_radius);
+        closest_distances.assign(point_count, std::numeric_limits<float>::max());
+        point_flags.assign(point_count, 0);
+        linked_radius = influence_radius;
+        links.node_starts.clear();
+        links.node_ends.clear();
+        links.point_indices.clear();
+        listed_nodes.assign(point_count, -1);
+        reached_listed.clear();
+        listed_count = 0;
+    }
 
-        if (closest_node != -1) {
-            point.linked_node = closest_node;
-#pragma omp critical
-            {
-                tree_node_manager.tree_nodes[closest_node].linked_points.push_back(&point);
+    // Only a node appended since the last update can be closer to a point than its linked node
+    const size_t first_new = linked_node_count;
+    const size_t new_count = node_count - first_new;
+    node_x.resize(new_count);
+    node_y.resize(new_count);
+    node_z.resize(new_count);
+    for (size_t i = 0; i < new_count; i++) {
+        node_x[i] = tree_node_manager.positions[first_new + i].x;
+        node_y[i] = tree_node_manager.positions[first_new + i].y;
+        node_z[i] = tree_node_manager.positions[first_new + i].z;
+    }
+    node_grid.Build(node_x.data(), node_y.data(), node_z.data(), new_count, influence_radius);
+
+    candidates.clear();
+    for (size_t i = 0; i < new_count; i++) {
+        const glm::vec3 node_position(node_x[i], node_y[i], node_z[i]);
+        point_grid.ForEachNear(node_position, [&](uint32_t p, const glm::vec3& point_position) {
+            if (point_flags[p] != 0 || attraction_points.Reached(p)) return;
+            const glm::vec3 diff = point_position - node_position;
+            if (glm::dot(diff, diff) <= influence_radius_sq) {
+                point_flags[p] = POINT_CANDIDATE;
+                candidates.push_back(p);
             }
+        });
+    }
+
+    #pragma omp parallel for if(candidates.size() > 1000)
+    for (long long c = 0; c < static_cast<long long>(candidates.size()); c++) {
+        const uint32_t p = candidates[c];
+        uint32_t closest_node;
+        float closest_distance_sq;
+        if (!node_grid.FindNearest(attraction_points.Position(p), closest_node, closest_distance_sq)) continue;
+
+        if (closest_distance_sq <= influence_radius_sq && closest_distance_sq < closest_distances[p]) {
+            closest_distances[p] = closest_distance_sq;
+            attraction_points.linked_node[p] = static_cast<int32_t>(first_new + closest_node);
+        }
+        if (closest_distance_sq <= min_distance_sq) {
+            point_flags[p] |= POINT_REACHED_NOW;
+        }
+    }
+    for (uint32_t p : candidates) {
+        if (point_flags[p] & POINT_REACHED_NOW) attraction_points.SetReached(p);
+    }
+
+    PatchLinks(first_new, node_count);
+
+    for (uint32_t p : candidates) {
+        point_flags[p] = 0;
+    }
+    linked_node_count = node_count;
+}
+
+void AttractionPointManager::MarkReachedNow() {
+    // A word per iteration, so no two threads touch the same word
+    const size_t point_count = attraction_points.Size();
+    #pragma omp parallel for if(point_count > 10000)
+    for (long long word = 0; word < static_cast<long long>(attraction_points.reached.size()); word++) {
+        const size_t begin = static_cast<size_t>(word) * 64;
+        const size_t end = std::min(point_count, begin + 64);
+        uint64_t bits = 0;
+        for (size_t p = begin; p < end; p++) {
+            if (point_flags[p] & POINT_REACHED_NOW) bits |= uint64_t(1) << (p - begin);
+        }
+        attraction_points.reached[word] |= bits;
+    }
+}
+
+void AttractionPointManager::BuildLinks(size_t node_count) {
+    // Points reached in an earlier update no longer attract, the ones reached now still do once
+    auto linked_node = [this](size_t p) -> size_t {
+        if (attraction_points.Reached(p) && !(point_flags[p] & POINT_REACHED_NOW)) return -1;
+        return attraction_points.linked_node[p] < 0 ? size_t(-1) : static_cast<size_t>(attraction_points.linked_node[p]);
+    };
+
+    // The points are split into one contiguous chunk per thread, whatever threads run them
+    const size_t point_count = attraction_points.Size();
+    long long chunks = 1;
+#ifdef _OPENMP
+    if (point_count > 10000) chunks = omp_get_max_threads();
+#endif
+    const size_t chunk_size = (point_count + chunks - 1) / chunks;
+
+    // Count the links of every node per chunk
+    link_histograms.assign(static_cast<size_t>(chunks) * node_count, 0);
+    #pragma omp parallel for if(chunks > 1)
+    for (long long c = 0; c < chunks; c++) {
+        uint32_t* histogram = link_histograms.data() + c * node_count;
+        const size_t begin = static_cast<size_t>(c) * chunk_size;
+        const size_t end = std::min(point_count, begin + chunk_size);
+        for (size_t p = begin; p < end; p++) {
+            const size_t node = linked_node(p);
+            if (node != static_cast<size_t>(-1)) histogram[node]++;
+        }
+    }
+
+    // Prefix sum node by node and chunk by chunk within a node, so every chunk
+    // writes its links of a node after those of the chunks before it
+    links.node_starts.resize(node_count);
+    links.node_ends.resize(node_count);
+    uint32_t total = 0;
+    for (size_t node = 0; node < node_count; node++) {
+        links.node_starts[node] = total;
+        for (long long c = 0; c < chunks; c++) {
+            uint32_t& slot = link_histograms[c * node_count + node];
+            const uint32_t count = slot;
+            slot = total;
+            total += count;
+        }
+        links.node_ends[node] = total;
+    }
+
+    // Scatter the point indices, each node's in point order for any thread count
+    links.point_indices.resize(total);
+    #pragma omp parallel for if(chunks > 1)
+    for (long long c = 0; c < chunks; c++) {
+        uint32_t* cursor = link_histograms.data() + c * node_count;
+        const size_t begin = static_cast<size_t>(c) * chunk_size;
+        const size_t end = std::min(point_count, begin + chunk_size);
+        for (size_t p = begin; p < end; p++) {
+            const size_t node = linked_node(p);
+            if (node != static_cast<size_t>(-1)) links.point_indices[cursor[node]++] = static_cast<uint32_t>(p);
+        }
+    }
+}
+
+void AttractionPointManager::PatchLinks(size_t first_new, size_t node_count) {
+    // Node whose row lists the point now, as in BuildLinks
+    auto listed_node = [this](size_t p) -> int32_t {
+        if (attraction_points.Reached(p) && !(point_flags[p] & POINT_REACHED_NOW)) return -1;
+        return attraction_points.linked_node[p];
+    };
+
+    // Only the candidates and the points reached by the last update are listed differently.
+    // A candidate stays with its node or moves to a new one, so older rows only shrink
+    shrunk_nodes.clear();
+    inserted.clear();
+    auto collect = [&](uint32_t p) {
+        const int32_t before = listed_nodes[p];
+        const int32_t after = listed_node(p);
+        if (before == after) return;
+        if (before >= 0) shrunk_nodes.push_back(static_cast<uint32_t>(before));
+        if (after >= 0) inserted.push_back(p);
+        listed_nodes[p] = after;
+    };
+    for (uint32_t p : reached_listed) collect(p);
+    for (uint32_t p : candidates) collect(p);
+
+    std::sort(shrunk_nodes.begin(), shrunk_nodes.end());
+    shrunk_nodes.erase(std::unique(shrunk_nodes.begin(), shrunk_nodes.end()), shrunk_nodes.end());
+    for (uint32_t node : shrunk_nodes) {
+        uint32_t out = links.node_starts[node];
+        for (uint32_t j = links.node_starts[node]; j < links.node_ends[node]; j++) {
+            const uint32_t p = links.point_indices[j];
+            if (listed_nodes[p] == static_cast<int32_t>(node)) links.point_indices[out++] = p;
         }
+        listed_count -= links.node_ends[node] - out;
+        links.node_ends[node] = out;
+    }
+
+    // Rows of the new nodes go after the others, each in point order
+    const size_t new_count = node_count - first_new;
+    std::sort(inserted.begin(), inserted.end());
+    link_histograms.assign(new_count, 0);
+    for (uint32_t p : inserted) {
+        link_histograms[listed_nodes[p] - first_new]++;
+    }
+    links.node_starts.resize(node_count);
+    links.node_ends.resize(node_count);
+    uint32_t total = static_cast<uint32_t>(links.point_indices.size());
+    for (size_t i = 0; i < new_count; i++) {
+        links.node_starts[first_new + i] = total;
+        const uint32_t count = link_histograms[i];
+        link_histograms[i] = total;
+        total += count;
+        links.node_ends[first_new + i] = total;
+    }
+    links.point_indices.resize(total);
+    for (uint32_t p : inserted) {
+        links.point_indices[link_histograms[listed_nodes[p] - first_new]++] = p;
+    }
+    listed_count += inserted.size();
+
+    // Points reached now are listed this once, the next update drops them
+    reached_listed.clear();
+    for (uint32_t p : candidates) {
+        if (point_flags[p] & POINT_REACHED_NOW) reached_listed.push_back(p);
     }
 
+    // Close the gaps once they outnumber the links, which keeps the cost amortized
+    if (links.point_indices.size() > 2 * listed_count + 4096) {
+        uint32_t out = 0;
+        for (size_t node = 0; node < node_count; node++) {
+            const uint32_t begin = links.node_starts[node];
+            const uint32_t end = links.node_ends[node];
+            links.node_starts[node] = out;
+            for (uint32_t j = begin; j < end; j++) {
+                links.point_indices[out++] = links.point_indices[j];
+            }
+            links.node_ends[node] = out;
+        }
+        links.point_indices.resize(out);
+    }
 }
 
 int AttractionPointManager::GetAvailablePointNumber() {
     int num = 0;
-    for (auto& point : attraction_points) {
-        if (!point.reached) num++;
+    for (size_t p = 0; p < attraction_points.Size(); p++) {
+        if (!attraction_points.Reached(p)) num++;
     }
     return num;
 }
 
 void AttractionPointManager::DebugPrintPoints(TreeNodeManager& tree_node_manager) {
-    int i = 0;
-    for (auto& point : attraction_points) {
-        printf("Attraction Point [%d] (%f, %f, %f), [%s]\n", i, point.position.x, point.position.y, point.position.z, point.reached ? "Reached" : "UnReached");
+    for (size_t i = 0; i < attraction_points.Size(); i++) {
+        const glm::vec3 position = attraction_points.Position(i);
+        const int32_t linked_node = attraction_points.linked_node[i];
+        printf("Attraction Point [%d] (%f, %f, %f), [%s]\n", static_cast<int>(i), position.x, position.y, position.z, attraction_points.Reached(i) ? "Reached" : "UnReached");
         printf("\tLinked to Node: ");
-        if (point.linked_node == -1) {
+        if (linked_node == -1) {
             printf("N/A\n\n");
         }
         else {
-            printf("(%f, %f, %f)\n\n", tree_node_manager.tree_nodes[point.linked_node].position.x, 
-                tree_node_manager.tree_nodes[point.linked_node].position.y, 
-                tree_node_manager.tree_nodes[point.linked_node].position.z);
+            printf("(%f, %f, %f)\n\n", tree_node_manager.positions[linked_node].x, 
+                tree_node_manager.positions[linked_node].y, 
+                tree_node_manager.positions[linked_node].z);
         }
-        i++;
     }
 }
\ No newline at end of file
@@ -0,0 +1,328 @@
+#include "leaf_batch.h"
+#include "counter_rng.h"
+#include <gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LEAF_BATCH_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Leaf angles are whole degrees drawn with UniformInt(-120, 120)
+#define LEAF_MIN_ANGLE -120
+#define LEAF_ANGLE_COUNT 241
+#define LEAF_MAX_OFFSET 0.4f
+#define DRAWS_PER_LEAF 3
+
+// Batches with fewer sites are generated on the calling thread
+#define PARALLEL_LEAF_MIN_SITES 1024
+
+// Exposure of a cluster at the crown centroid, the outermost one has 1
+#define LEAF_BUDGET_MIN_EXPOSURE 0.1
+
+// Rz(a) * Rx(a) * Ry(a) for every leaf angle, columns padded to four floats.
+// With whole-degree angles a table is exact and replaces three sine/cosine
+// pairs and three matrix products per leaf.
+struct LeafRotationTable {
+    float columns[LEAF_ANGLE_COUNT][3][4];
+
+    LeafRotationTable() {
+        for (int i = 0; i < LEAF_ANGLE_COUNT; i++) {
+            const float angle = glm::radians(static_cast<float>(LEAF_MIN_ANGLE + i));
+            glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), angle, glm::vec3(0.0f, 0.0f, 1.0f));
+            rotation = glm::rotate(rotation, angle, glm::vec3(1.0f, 0.0f, 0.0f));
+            rotation = glm::rotate(rotation, angle, glm::vec3(0.0f, 1.0f, 0.0f));
+            for (int column = 0; column < 3; column++) {
+                for (int row = 0; row < 4; row++) {
+                    columns[i][column][row] = rotation[column][row];
+                }
+            }
+        }
+    }
+};
+
+static const LeafRotationTable& leafRotations() {
+    static const LeafRotationTable table;
+    return table;
+}
+
+#ifdef LEAF_BATCH_SSE2
+// Low and high halves of the 32x32-bit products of every lane with `multiplier`
+static inline void multiplyWide(__m128i a, __m128i multiplier, __m128i& lo, __m128i& hi) {
+    const __m128i lowMask = _mm_set_epi32(0, -1, 0, -1);
+    const __m128i even = _mm_mul_epu32(a, multiplier);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), multiplier);
+    lo = _mm_or_si128(_mm_and_si128(even, lowMask), _mm_slli_epi64(odd, 32));
+    hi = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(lowMask, odd));
+}
+
+// CounterRng blocks [first, first + 4), one per lane, stored in draw order
+static void philoxBlocks4(uint64_t seed, uint64_t index, uint32_t domain, uint32_t first, uint32_t* draws) {
+    __m128i c0 = _mm_set1_epi32(static_cast<int>(static_cast<uint32_t>(index)));
+    __m128i c1 = _mm_set1_epi32(static_cast<int>(static_cast<uint32_t>(index >> 32)));
+    __m128i c2 = _mm_set1_epi32(static_cast<int>(domain));
+    __m128i c3 = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(first)), _mm_set_epi32(3, 2, 1, 0));
+    uint32_t k0 = static_cast<uint32_t>(seed), k1 = static_cast<uint32_t>(seed >> 32);
+    const __m128i multiplier0 = _mm_set1_epi32(static_cast<int>(CounterRng::MULTIPLIER0));
+    const __m128i multiplier1 = _mm_set1_epi32(static_cast<int>(CounterRng::MULTIPLIER1));
+    for (int round = 0; round < CounterRng::ROUNDS; round++) {
+        __m128i lo0, hi0, lo1, hi1;
+        multiplyWide(c0, multiplier0, lo0, hi0);
+        multiplyWide(c2, multiplier1, lo1, hi1);
+        c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1), _mm_set1_epi32(static_cast<int>(k0)));
+        c1 = lo1;
+        c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3), _mm_set1_epi32(static_cast<int>(k1)));
+        c3 = lo0;
+        k0 += CounterRng::KEY_STEP0;
+        k1 += CounterRng::KEY_STEP1;
+    }
+
+    // Lane j holds word i of block j in c<i>, transpose to block after block
+    const __m128i t0 = _mm_unpacklo_epi32(c0, c1), t1 = _mm_unpackhi_epi32(c0, c1);
+    const __m128i t2 = _mm_unpacklo_epi32(c2, c3), t3 = _mm_unpackhi_epi32(c2, c3);
+    __m128i* out = reinterpret_cast<__m128i*>(draws);
+    _mm_storeu_si128(out + 0, _mm_unpacklo_epi64(t0, t2));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi64(t0, t2));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi64(t1, t3));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi64(t1, t3));
+}
+#endif
+
+#ifdef __AVX2__
+static inline void multiplyWide8(__m256i a, __m256i multiplier, __m256i& lo, __m256i& hi) {
+    const __m256i lowMask = _mm256_set1_epi64x(0xFFFFFFFFll);
+    const __m256i even = _mm256_mul_epu32(a, multiplier);
+    const __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), multiplier);
+    lo = _mm256_or_si256(_mm256_and_si256(even, lowMask), _mm256_slli_epi64(odd, 32));
+    hi = _mm256_or_si256(_mm256_srli_epi64(even, 32), _mm256_andnot_si256(lowMask, odd));
+}
+
+// As philoxBlocks4, blocks [first, first + 8)
+static void philoxBlocks8(uint64_t seed, uint64_t index, uint32_t domain, uint32_t first, uint32_t* draws) {
+    __m256i c0 = _mm256_set1_epi32(static_cast<int>(static_cast<uint32_t>(index)));
+    __m256i c1 = _mm256_set1_epi32(static_cast<int>(static_cast<uint32_t>(index >> 32)));
+    __m256i c2 = _mm256_set1_epi32(static_cast<int>(domain));
+    __m256i c3 = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(first)), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    uint32_t k0 = static_cast<uint32_t>(seed), k1 = static_cast<uint32_t>(seed >> 32);
+    const __m256i multiplier0 = _mm256_set1_epi32(static_cast<int>(CounterRng::MULTIPLIER0));
+    const __m256i multiplier1 = _mm256_set1_epi32(static_cast<int>(CounterRng::MULTIPLIER1));
+    for (int round = 0; round < CounterRng::ROUNDS; round++) {
+        __m256i lo0, hi0, lo1, hi1;
+        multiplyWide8(c0, multiplier0, lo0, hi0);
+        multiplyWide8(c2, multiplier1, lo1, hi1);
+        c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(static_cast<int>(k0)));
+        c1 = lo1;
+        c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(static_cast<int>(k1)));
+        c3 = lo0;
+        k0 += CounterRng::KEY_STEP0;
+        k1 += CounterRng::KEY_STEP1;
+    }
+
+    // Unpacks work within 128-bit halves: blocks 0-3 end up in the low halves, 4-7 in the high ones
+    const __m256i t0 = _mm256_unpacklo_epi32(c0, c1), t1 = _mm256_unpackhi_epi32(c0, c1);
+    const __m256i t2 = _mm256_unpacklo_epi32(c2, c3), t3 = _mm256_unpackhi_epi32(c2, c3);
+    const __m256i b04 = _mm256_unpacklo_epi64(t0, t2), b15 = _mm256_unpackhi_epi64(t0, t2);
+    const __m256i b26 = _mm256_unpacklo_epi64(t1, t3), b37 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i* out = reinterpret_cast<__m256i*>(draws);
+    _mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(b04, b15, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(b26, b37, 0x20));
+    _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(b04, b15, 0x31));
+    _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(b26, b37, 0x31));
+}
+#endif
+
+// Draws [0, 4 * blocks) of CounterRng(seed, index, domain); `blocks` is rounded
+// up to a multiple of four, `draws` must have room for that
+static void generateDraws(uint64_t seed, uint64_t index, uint32_t domain, uint32_t blocks, uint32_t* draws) {
+#ifdef LEAF_BATCH_SSE2
+    uint32_t block = 0;
+#ifdef __AVX2__
+    for (; block + 8 <= blocks; block += 8) {
+        philoxBlocks8(seed, index, domain, block, draws + 4 * block);
+    }
+#endif
+    for (; block < blocks; block += 4) {
+        philoxBlocks4(seed, index, domain, block, draws + 4 * block);
+    }
+#else
+    CounterRng rng(seed, index, domain);
+    for (uint32_t i = 0; i < 4 * blocks; i++) {
+        draws[i] = rng.NextUInt();
+    }
+#endif
+}
+
+// Same arithmetic as CounterRng::UniformInt(LEAF_MIN_ANGLE, -LEAF_MIN_ANGLE), as a table row
+static inline uint32_t angleIndex(uint32_t draw) {
+    return static_cast<uint32_t>((static_cast<uint64_t>(draw) * LEAF_ANGLE_COUNT) >> 32);
+}
+
+// Same arithmetic as CounterRng::Uniform(-LEAF_MAX_OFFSET, LEAF_MAX_OFFSET)
+static inline float offset(uint32_t draw) {
+    return -LEAF_MAX_OFFSET + (LEAF_MAX_OFFSET - -LEAF_MAX_OFFSET) * ((draw >> 8) * (1.0f / 16777216.0f));
+}
+
+// Leaf = anchor * scale * Rz(a) * Rx(a) * Ry(a) * translate(x, y, 0). The scaled
+// anchor is shared by the cluster, so a leaf costs nine multiply-adds of
+// columns plus two for the offset, and a transpose to rows.
+static void generateSite(const LeafSite& site, std::vector<uint32_t>& draws, AffineInstance* out) {
+    if (site.count == 0) return;
+
+    const uint32_t drawCount = site.firstDraw + DRAWS_PER_LEAF * site.count;
+    const uint32_t blocks = ((drawCount + 3) / 4 + 3) & ~3u;
+    if (draws.size() < 4 * blocks) draws.resize(4 * blocks);
+    generateDraws(site.seed, site.index, site.domain, blocks, draws.data());
+
+    const LeafRotationTable& rotations = leafRotations();
+    const uint32_t* leafDraws = draws.data() + site.firstDraw;
+
+#ifdef LEAF_BATCH_SSE2
+    const __m128 scale = _mm_set1_ps(site.scale);
+    const __m128 a0 = _mm_mul_ps(_mm_loadu_ps(&site.anchor[0][0]), scale);
+    const __m128 a1 = _mm_mul_ps(_mm_loadu_ps(&site.anchor[1][0]), scale);
+    const __m128 a2 = _mm_mul_ps(_mm_loadu_ps(&site.anchor[2][0]), scale);
+    const __m128 origin = _mm_loadu_ps(&site.anchor[3][0]);
+    for (uint32_t i = 0; i < site.count; i++, leafDraws += DRAWS_PER_LEAF) {
+        const float (*rotation)[4] = rotations.columns[angleIndex(leafDraws[0])];
+        __m128 columns[3];
+        for (int c = 0; c < 3; c++) {
+            columns[c] = _mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(a0, _mm_set1_ps(rotation[c][0])),
+                _mm_mul_ps(a1, _mm_set1_ps(rotation[c][1]))),
+                _mm_mul_ps(a2, _mm_set1_ps(rotation[c][2])));
+        }
+        __m128 position = origin;
+        if (site.translate) {
+            position = _mm_add_ps(position, _mm_add_ps(
+                _mm_mul_ps(columns[0], _mm_set1_ps(offset(leafDraws[1]))),
+                _mm_mul_ps(columns[1], _mm_set1_ps(offset(leafDraws[2])))));
+        }
+        _MM_TRANSPOSE4_PS(columns[0], columns[1], columns[2], position);
+        float* leaf = &out[i].rows[0][0];
+        _mm_storeu_ps(leaf + 0, columns[0]);
+        _mm_storeu_ps(leaf + 4, columns[1]);
+        _mm_storeu_ps(leaf + 8, columns[2]);
+    }
+#else
+    const glm::vec4 a0 = site.anchor[0] * site.scale;
+    const glm::vec4 a1 = site.anchor[1] * site.scale;
+    const glm::vec4 a2 = site.anchor[2] * site.scale;
+    for (uint32_t i = 0; i < site.count; i++, leafDraws += DRAWS_PER_LEAF) {
+        const float (*rotation)[4] = rotations.columns[angleIndex(leafDraws[0])];
+        glm::mat4 leaf;
+        for (int c = 0; c < 3; c++) {
+            leaf[c] = a0 * rotation[c][0] + a1 * rotation[c][1] + a2 * rotation[c][2];
+        }
+        leaf[3] = site.anchor[3];
+        if (site.translate) {
+            leaf[3] += leaf[0] * offset(leafDraws[1]) + leaf[1] * offset(leafDraws[2]);
+        }
+        out[i] = AffineInstance(leaf);
+    }
+#endif
+}
+
+bool generateLeafBatch(const std::vector<LeafSite>& sites, InstanceSink& leafTransforms,
+    const std::atomic<bool>* cancel) {
+    size_t total = 0;
+    for (const LeafSite& site : sites) {
+        total += site.count;
+    }
+
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    std::vector<uint32_t> draws;
+    if (threads == 1 || sites.size() < PARALLEL_LEAF_MIN_SITES) {
+        // Build each cluster in a small buffer that stays in cache and append it,
+        // the output is written once instead of zero-filled first
+        leafTransforms.reserve(total);
+        std::vector<AffineInstance> cluster;
+        for (const LeafSite& site : sites) {
+            if (cancel && cancel->load(std::memory_order_relaxed)) return false;
+            if (cluster.size() < site.count) cluster.resize(site.count);
+            generateSite(site, draws, cluster.data());
+            leafTransforms.append(cluster.data(), site.count);
+        }
+        return true;
+    }
+
+    // Every site writes its own slice of the output
+    std::vector<size_t> offsets(sites.size() + 1, 0);
+    for (size_t s = 0; s < sites.size(); s++) {
+        offsets[s + 1] = offsets[s] + sites[s].count;
+    }
+    AffineInstance* leaves = leafTransforms.extend(total);
+
+    const long long siteCount = static_cast<long long>(sites.size());
+    #pragma omp parallel firstprivate(draws)
+    {
+        #pragma omp for schedule(static)
+        for (long long s = 0; s < siteCount; s++) {
+            if (cancel && cancel->load(std::memory_order_relaxed)) continue;
+            generateSite(sites[s], draws, leaves + offsets[s]);
+        }
+    }
+    return !(cancel && cancel->load(std::memory_order_relaxed));
+}
+
+void distributeLeafBudget(std::vector<LeafSite>& sites, uint64_t budget) {
+    uint64_t total = 0;
+    glm::dvec3 centroid(0.0);
+    for (const LeafSite& site : sites) {
+        total += site.count;
+        centroid += static_cast<double>(site.count) * glm::dvec3(site.anchor[3]);
+    }
+    if (total <= budget) return;
+    centroid /= static_cast<double>(total);
+
+    std::vector<double> exposure(sites.size());
+    double farthest = 0.0;
+    for (size_t s = 0; s < sites.size(); s++) {
+        exposure[s] = glm::length(glm::dvec3(sites[s].anchor[3]) - centroid);
+        farthest = std::max(farthest, exposure[s]);
+    }
+    double weighted = 0.0;  // sum of count * exposure over clusters that are not full
+    for (size_t s = 0; s < sites.size(); s++) {
+        const double distance = farthest > 0.0 ? exposure[s] / farthest : 1.0;
+        exposure[s] = LEAF_BUDGET_MIN_EXPOSURE + (1.0 - LEAF_BUDGET_MIN_EXPOSURE) * distance;
+        weighted += sites[s].count * exposure[s];
+    }
+
+    // The most exposed clusters fill up first as k grows. Walk them in that order
+    // until k, solved with the clusters so far full, leaves the next one partial
+    std::vector<uint32_t> order(sites.size());
+    for (size_t s = 0; s < sites.size(); s++) {
+        order[s] = static_cast<uint32_t>(s);
+    }
+    std::stable_sort(order.begin(), order.end(), [&exposure](uint32_t a, uint32_t b) { return exposure[a] > exposure[b]; });
+    double full = 0.0;
+    double k = 0.0;
+    for (uint32_t s : order) {
+        if (sites[s].count == 0) continue;
+        k = (static_cast<double>(budget) - full) / weighted;
+        if (k * exposure[s] < 1.0) break;
+        full += sites[s].count;
+        weighted -= sites[s].count * exposure[s];
+    }
+
+    // Round the running total rather than each cluster, so the fractions add up to the budget
+    double expected = 0.0;
+    uint64_t assigned = 0;
+    for (size_t s = 0; s < sites.size(); s++) {
+        expected += sites[s].count * std::min(1.0, k * exposure[s]);
+        const uint64_t target = std::min(static_cast<uint64_t>(expected + 0.5), budget);
+        const uint64_t count = std::min<uint64_t>(target - std::min(target, assigned), sites[s].count);
+        sites[s].count = static_cast<uint32_t>(count);
+        assigned += count;
+    }
+}
@@ -0,0 +1,750 @@
+#include "lsystem.h"
+#include "counter_rng.h"
+#include "leaf_batch.h"
+#include "lsystem_parametric.h"
+#include "lsystem_presets.h"
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+LSystemGrammar::LSystemGrammar(const std::string& axiom, const std::unordered_map<char, LSystemRule>& rules, int seed,
+    const std::string& contextIgnored) {
+    this->axiom = axiom;
+    this->seed = seed;
+    this->contextIgnored = contextIgnored;
+
+    is_context_ignored.fill(false);
+    parameter_counts.fill(0);
+    for (char c : contextIgnored) {
+        is_context_ignored[static_cast<unsigned char>(c)] = true;
+    }
+    for (int c = 0; c < 256; c++) {
+        productions[c] = std::string(1, static_cast<char>(c));
+        unchanged[c] = productions[c];
+        is_identity[c] = true;
+        is_stochastic[c] = false;
+        is_contextual[c] = false;
+    }
+    for (const auto& rule : rules) {
+        const unsigned char symbol = static_cast<unsigned char>(rule.first);
+        const std::vector<LSystemProduction>& options = rule.second.productions;
+        if (options.empty()) continue;
+
+        productions[symbol] = options[0].successor;
+        is_identity[symbol] = false;
+
+        for (const LSystemProduction& option : options) {
+            is_contextual[symbol] = is_contextual[symbol] || !option.left.empty() || !option.right.empty();
+        }
+        if (is_contextual[symbol]) {
+            // Weights are compared among the applicable productions of each occurrence
+            for (const LSystemProduction& option : options) {
+                const int specificity = (option.left.empty() ? 0 : 1) + (option.right.empty() ? 0 : 1);
+                context_productions[symbol].push_back({ option.left, option.right, option.successor, option.weight, specificity });
+                uses_left_context = uses_left_context || !option.left.empty();
+                uses_right_context = uses_right_context || !option.right.empty();
+            }
+            context_sensitive = true;
+            continue;
+        }
+        if (options.size() == 1) continue;
+
+        float total = 0.0f;
+        for (const LSystemProduction& option : options) {
+            alternatives[symbol].push_back(option.successor);
+            total += std::max(option.weight, 0.0f);
+            cumulative_weights[symbol].push_back(total);
+        }
+        // Rules whose weights are all zero fall back to their first production
+        is_stochastic[symbol] = total > 0.0f;
+        stochastic = stochastic || is_stochastic[symbol];
+    }
+    for (int c = 0; c < 256; c++) {
+        production_lengths[c] = productions[c].size();
+    }
+}
+
+// `symbols` with every parameter list removed, F(l*0.7)[+(30)F] becomes F[+F]
+static std::string stripParameters(const std::string& symbols) {
+    std::string stripped;
+    stripped.reserve(symbols.size());
+    int nesting = 0;
+    for (char c : symbols) {
+        if (c == '(') nesting++;
+        else if (c == ')') nesting = std::max(nesting - 1, 0);
+        else if (nesting == 0) stripped.push_back(c);
+    }
+    return stripped;
+}
+
+// Raise `counts` to the parameters of every module of `symbols`, F(l,w*0.8) has 2
+static void countParameters(const std::string& symbols, std::array<uint8_t, 256>& counts) {
+    int nesting = 0;
+    int parameters = 0;
+    unsigned char module = 0;
+    for (char c : symbols) {
+        if (c == '(') {
+            if (nesting++ == 0) parameters = 1;
+        }
+        else if (c == ')') {
+            nesting = std::max(nesting - 1, 0);
+            if (nesting == 0) counts[module] = std::max(counts[module], static_cast<uint8_t>(std::min(parameters, 255)));
+        }
+        else if (c == ',' && nesting == 1) {
+            parameters++;
+        }
+        else if (nesting == 0) {
+            module = static_cast<unsigned char>(c);
+        }
+    }
+}
+
+bool LSystemGrammar::IsParametric(const LSystemParameters& params) {
+    if (!params.formalParameters.empty() || params.axiom.find('(') != std::string::npos) return true;
+    for (const auto& rule : params.rules) {
+        for (const LSystemProduction& production : rule.second.productions) {
+            if (production.successor.find('(') != std::string::npos) return true;
+        }
+    }
+    return false;
+}
+
+LSystemGrammar LSystemGrammar::FromParameters(const LSystemParameters& params) {
+    if (!IsParametric(params)) {
+        return LSystemGrammar(params.axiom, params.rules, params.seed, params.contextIgnored);
+    }
+
+    std::unordered_map<char, LSystemRule> rules = params.rules;
+    std::array<uint8_t, 256> parameter_counts = {};
+    countParameters(params.axiom, parameter_counts);
+    for (auto& rule : rules) {
+        for (LSystemProduction& production : rule.second.productions) {
+            countParameters(production.successor, parameter_counts);
+            production.successor = stripParameters(production.successor);
+        }
+    }
+    LSystemGrammar grammar(stripParameters(params.axiom), rules, params.seed, params.contextIgnored);
+    grammar.parametric = true;
+    grammar.parameter_counts = parameter_counts;
+    return grammar;
+}
+
+const std::string& LSystemGrammar::Choose(unsigned char symbol, int generation, uint64_t index) const {
+    // Domain 0 belongs to the turtle, generation g draws from domain g + 1
+    CounterRng rng(static_cast<uint32_t>(seed), index, static_cast<uint32_t>(generation) + 1);
+    const std::vector<float>& weights = cumulative_weights[symbol];
+    const float pick = rng.NextFloat() * weights.back();
+    const size_t option = std::upper_bound(weights.begin(), weights.end(), pick) - weights.begin();
+    return alternatives[symbol][std::min(option, weights.size() - 1)];
+}
+
+void LSystemGrammar::BuildContext(const std::string& current, ContextTables& context) const {
+    // ClampDepth keeps the generations of context-sensitive grammars below 4G symbols
+    const size_t size = current.size();
+    context.symbols = current.data();
+
+    std::vector<uint32_t> saved;
+
+    // Left to right: a branch starts with the symbol before its '[' as context,
+    // and its ']' restores the context from before the branch.
+    // Only the directions some production looks in are built.
+    if (uses_left_context) {
+        context.left.resize(size);
+        uint32_t nearest = ContextTables::NO_SYMBOL;
+        for (size_t i = 0; i < size; i++) {
+            const unsigned char c = static_cast<unsigned char>(current[i]);
+            context.left[i] = nearest;
+            if (c == '[') {
+                saved.push_back(nearest);
+            }
+            else if (c == ']') {
+                nearest = saved.empty() ? ContextTables::NO_SYMBOL : saved.back();
+                if (!saved.empty()) saved.pop_back();
+            }
+            else if (!is_context_ignored[c]) {
+                nearest = static_cast<uint32_t>(i);
+            }
+        }
+    }
+
+    // Right to left: a branch ends without context and the symbols before its
+    // '[' see past it to the symbol after its ']'
+    if (uses_right_context) {
+        context.right.resize(size);
+        saved.clear();
+        uint32_t nearest = ContextTables::NO_SYMBOL;
+        for (size_t i = size; i-- > 0; ) {
+            const unsigned char c = static_cast<unsigned char>(current[i]);
+            context.right[i] = nearest;
+            if (c == ']') {
+                saved.push_back(nearest);
+                nearest = ContextTables::NO_SYMBOL;
+            }
+            else if (c == '[') {
+                nearest = saved.empty() ? ContextTables::NO_SYMBOL : saved.back();
+                if (!saved.empty()) saved.pop_back();
+            }
+            else if (!is_context_ignored[c]) {
+                nearest = static_cast<uint32_t>(i);
+            }
+        }
+    }
+}
+
+bool LSystemGrammar::MatchesContext(const ContextProduction& production, const ContextTables& context, uint64_t index) const {
+    uint32_t position = static_cast<uint32_t>(index);
+    for (size_t k = production.left.size(); k-- > 0; ) {
+        position = context.left[position];
+        if (position == ContextTables::NO_SYMBOL || context.symbols[position] != production.left[k]) return false;
+    }
+    position = static_cast<uint32_t>(index);
+    for (char c : production.right) {
+        position = context.right[position];
+        if (position == ContextTables::NO_SYMBOL || context.symbols[position] != c) return false;
+    }
+    return true;
+}
+
+const std::string& LSystemGrammar::ChooseInContext(unsigned char symbol, int generation, uint64_t index,
+    const ContextTables& context) const {
+    // Only the most specific applicable productions compete
+    const std::vector<ContextProduction>& options = context_productions[symbol];
+    int best = -1;
+    size_t first = 0;
+    size_t matches = 0;
+    float total = 0.0f;
+    for (size_t i = 0; i < options.size(); i++) {
+        if (options[i].specificity < best || !MatchesContext(options[i], context, index)) continue;
+        if (options[i].specificity > best) {
+            best = options[i].specificity;
+            first = i;
+            matches = 0;
+            total = 0.0f;
+        }
+        matches++;
+        total += std::max(options[i].weight, 0.0f);
+    }
+    if (best < 0) return unchanged[symbol];
+    if (matches == 1 || total <= 0.0f) return options[first].successor;
+
+    // Same key as Choose
+    CounterRng rng(static_cast<uint32_t>(seed), index, static_cast<uint32_t>(generation) + 1);
+    float pick = rng.NextFloat() * total;
+    size_t chosen = first;
+    for (size_t i = first; i < options.size(); i++) {
+        if (options[i].specificity != best || !MatchesContext(options[i], context, index)) continue;
+        chosen = i;
+        pick -= std::max(options[i].weight, 0.0f);
+        if (pick < 0.0f) break;
+    }
+    return options[chosen].successor;
+}
+
+// Symbols per block of the parallel rewrite; small strings stay on one thread
+#define REWRITE_BLOCK_SIZE (long long)65536
+
+size_t LSystemGrammar::CountRange(const char* begin, const char* end, int generation, uint64_t index,
+    const ContextTables* context) const {
+    size_t length = 0;
+    for (const char* c = begin; c != end; c++, index++) {
+        const unsigned char symbol = static_cast<unsigned char>(*c);
+        if (is_contextual[symbol]) {
+            length += ChooseInContext(symbol, generation, index, *context).size();
+        }
+        else {
+            length += is_stochastic[symbol] ? Choose(symbol, generation, index).size() : production_lengths[symbol];
+        }
+    }
+    return length;
+}
+
+void LSystemGrammar::WriteRange(const char* begin, const char* end, int generation, uint64_t index,
+    const ContextTables* context, char* out) const {
+    for (const char* c = begin; c != end; c++, index++) {
+        const unsigned char symbol = static_cast<unsigned char>(*c);
+        const std::string& production = is_contextual[symbol]
+            ? ChooseInContext(symbol, generation, index, *context)
+            : Successor(*c, generation, index);
+        const size_t length = production.size();
+        if (length == 1) {
+            *out = production[0];
+        }
+        else {
+            std::memcpy(out, production.data(), length);
+        }
+        out += length;
+    }
+}
+
+size_t LSystemGrammar::NextLength(const std::string& current, int generation) const {
+    ContextTables context;
+    if (context_sensitive) BuildContext(current, context);
+    return CountRange(current.data(), current.data() + current.size(), generation, 0, &context);
+}
+
+void LSystemGrammar::Rewrite(const std::string& current, std::string& next, int generation) const {
+    const long long size = static_cast<long long>(current.size());
+    const long long block_count = (size + REWRITE_BLOCK_SIZE - 1) / REWRITE_BLOCK_SIZE;
+    const char* data = current.data();
+
+    // Context lookups need the bracket structure of the whole generation, built once up front
+    ContextTables context;
+    if (context_sensitive) BuildContext(current, context);
+
+    // Output length of every block, then an exclusive prefix sum turns them into write offsets
+    std::vector<size_t> block_offsets(block_count + 1, 0);
+
+    #pragma omp parallel for if(block_count > 1)
+    for (long long b = 0; b < block_count; b++) {
+        const long long begin = b * REWRITE_BLOCK_SIZE;
+        const long long end = std::min(begin + REWRITE_BLOCK_SIZE, size);
+        block_offsets[b + 1] = CountRange(data + begin, data + end, generation, begin, &context);
+    }
+    for (long long b = 0; b < block_count; b++) {
+        block_offsets[b + 1] += block_offsets[b];
+    }
+
+    next.resize(block_offsets[block_count]);
+    char* out = &next[0];
+
+    // Every block scatters its productions into its own slice of the output
+    #pragma omp parallel for if(block_count > 1)
+    for (long long b = 0; b < block_count; b++) {
+        const long long begin = b * REWRITE_BLOCK_SIZE;
+        const long long end = std::min(begin + REWRITE_BLOCK_SIZE, size);
+        WriteRange(data + begin, data + end, generation, begin, &context, out + block_offsets[b]);
+    }
+}
+
+// a + b and a * b clamped to the largest count instead of wrapping around
+static uint64_t saturatingAdd(uint64_t a, uint64_t b) {
+    return a > UINT64_MAX - b ? UINT64_MAX : a + b;
+}
+
+static uint64_t saturatingMultiply(uint64_t a, uint64_t b) {
+    return (b != 0 && a > UINT64_MAX / b) ? UINT64_MAX : a * b;
+}
+
+uint64_t LSystemSizePrediction::Bytes(bool materialized) const {
+    uint64_t bytes = saturatingMultiply(saturatingAdd(branches, leaves), sizeof(AffineInstance));
+    // Every site is kept until the leaves are generated, however few the budget lets through
+    bytes = saturatingAdd(bytes, saturatingMultiply(leafSites, sizeof(LeafSite)));
+    if (materialized) {
+        bytes = saturatingAdd(bytes, saturatingMultiply(symbols, 1 + sizeof(TurtleOp)));
+    }
+    // Parametric modules are packed into words, and a module with parameters may
+    // multiply out a transform and trie node of its own, or a branch width
+    bytes = saturatingAdd(bytes, saturatingMultiply(moduleWords, sizeof(uint32_t)));
+    const uint64_t literalBytes = sizeof(TurtleFrame) + sizeof(std::array<uint32_t, TurtleProgram::TRANSFORM_KINDS>) + sizeof(float);
+    return saturatingAdd(bytes, saturatingMultiply(literals, literalBytes));
+}
+
+template <typename Visitor>
+bool LSystemGrammar::PredictGenerations(int depth, int maxLeafCount, int leafBudget, Visitor&& visit) const {
+    depth = std::min(depth, LSYSTEM_MAX_DEPTH);
+
+    // Sparse rows of the production-count matrix: how often each symbol appears in a production
+    std::array<std::vector<std::pair<unsigned char, uint64_t>>, 256> matrix;
+    for (int c = 0; c < 256; c++) {
+        if (is_identity[c]) continue;
+
+        std::array<uint64_t, 256> occurrences = {};
+        if (is_stochastic[c] || is_contextual[c]) {
+            // Upper bound: as many of every symbol as the production with the most of it
+            std::vector<std::string> options = alternatives[c];
+            if (is_contextual[c]) {
+                options.assign(1, unchanged[c]);
+                for (const ContextProduction& production : context_productions[c]) {
+                    options.push_back(production.successor);
+                }
+            }
+            for (const std::string& production : options) {
+                std::array<uint64_t, 256> option = {};
+                for (char symbol : production) {
+                    option[static_cast<unsigned char>(symbol)]++;
+                }
+                for (int symbol = 0; symbol < 256; symbol++) {
+                    occurrences[symbol] = std::max(occurrences[symbol], option[symbol]);
+                }
+            }
+        }
+        else {
+            for (char symbol : productions[c]) {
+                occurrences[static_cast<unsigned char>(symbol)]++;
+            }
+        }
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (occurrences[symbol] != 0) {
+                matrix[c].push_back({ static_cast<unsigned char>(symbol), occurrences[symbol] });
+            }
+        }
+    }
+
+    std::array<uint64_t, 256> counts = {};
+    for (char c : axiom) {
+        counts[static_cast<unsigned char>(c)]++;
+    }
+
+    const uint64_t leavesPerSite = static_cast<uint64_t>(std::max(maxLeafCount, 0));
+    for (int generation = 0; ; generation++) {
+        LSystemSizePrediction prediction;
+        for (int c = 0; c < 256; c++) {
+            prediction.symbols = saturatingAdd(prediction.symbols, counts[c]);
+        }
+        prediction.branches = saturatingAdd(counts['F'], saturatingAdd(counts['X'], counts['Y']));
+        prediction.leaves = saturatingMultiply(counts['L'], leavesPerSite);
+        prediction.leafSites = counts['L'];
+        if (leafBudget > 0) {
+            prediction.leaves = std::min(prediction.leaves, static_cast<uint64_t>(leafBudget));
+        }
+        if (parametric) {
+            for (int c = 0; c < 256; c++) {
+                prediction.moduleWords = saturatingAdd(prediction.moduleWords, saturatingMultiply(counts[c], 1 + parameter_counts[c]));
+                if (parameter_counts[c] != 0) prediction.literals = saturatingAdd(prediction.literals, counts[c]);
+            }
+        }
+        if (!visit(generation, prediction)) return false;
+        // Saturated counts say nothing about deeper generations
+        if (prediction.symbols == UINT64_MAX) return false;
+        if (generation >= depth) return true;
+
+        std::array<uint64_t, 256> next = {};
+        for (int c = 0; c < 256; c++) {
+            if (counts[c] == 0) continue;
+            if (is_identity[c]) {
+                next[c] = saturatingAdd(next[c], counts[c]);
+                continue;
+            }
+            for (const auto& entry : matrix[c]) {
+                next[entry.first] = saturatingAdd(next[entry.first], saturatingMultiply(counts[c], entry.second));
+            }
+        }
+        // Settled counts repeat in every deeper generation
+        if (next == counts) return true;
+        counts = next;
+    }
+}
+
+std::vector<LSystemSizePrediction> LSystemGrammar::Predict(int depth, int maxLeafCount, int leafBudget) const {
+    std::vector<LSystemSizePrediction> predictions;
+    PredictGenerations(depth, maxLeafCount, leafBudget, [&](int, const LSystemSizePrediction& prediction) {
+        predictions.push_back(prediction);
+        return true;
+    });
+    return predictions;
+}
+
+int LSystemGrammar::ClampDepth(const LSystemParameters& params) const {
+    const uint64_t maxInstances = static_cast<uint64_t>(std::max(params.maxInstances, 0));
+    const uint64_t maxBytes = static_cast<uint64_t>(std::max(params.maxMemoryMB, 0)) << 20;
+    const int requested = std::min(params.depth, LSYSTEM_MAX_DEPTH);
+
+    int depth = 0;
+    const bool fits = PredictGenerations(requested, params.maxLeafCount, params.leafBudget,
+        [&](int generation, const LSystemSizePrediction& prediction) {
+            if (generation == 0) return true;
+            if (saturatingAdd(prediction.branches, prediction.leaves) > maxInstances) return false;
+            // Context tables hold 32-bit positions, whatever memory the budget allows
+            if (context_sensitive && prediction.symbols > ContextTables::NO_SYMBOL) return false;
+            // Parametric grammars are always expanded, streaming or not
+            if (prediction.Bytes(!params.streamDerivation || parametric) > maxBytes) return false;
+            depth = generation;
+            return true;
+        });
+    // Generations past settled counts fit as well as the last one predicted
+    return fits ? std::max(requested, 0) : depth;
+}
+
+std::string LSystemGrammar::Expand(int depth) const {
+    std::string current = axiom;
+    std::string next;
+    for (int i = 0; i < depth; i++) {
+        Rewrite(current, next, i);
+        std::swap(current, next);
+    }
+    return current;
+}
+
+const std::string& LSystemDerivationCache::Expand(const LSystemGrammar& grammar,
+    const std::unordered_map<char, LSystemRule>& rules, int depth, const std::atomic<bool>* cancel) {
+    if (generations.empty() || grammar.axiom != axiom || rules != this->rules ||
+        (grammar.IsStochastic() && grammar.seed != seed) ||
+        (grammar.IsContextSensitive() && grammar.contextIgnored != contextIgnored)) {
+        axiom = grammar.axiom;
+        this->rules = rules;
+        seed = grammar.seed;
+        contextIgnored = grammar.contextIgnored;
+        generations.assign(1, axiom);
+    }
+
+    while (static_cast<int>(generations.size()) <= depth) {
+        // Every generation kept is complete, a later call continues from the deepest one
+        if (cancel && cancel->load(std::memory_order_relaxed)) return generations.back();
+        generations.emplace_back();
+        grammar.Rewrite(generations[generations.size() - 2], generations.back(),
+            static_cast<int>(generations.size()) - 2);
+    }
+    return generations[std::max(depth, 0)];
+}
+
+TurtleProgram::TurtleProgram(const LSystemParameters& params) {
+    step = KindTransform(STEP_KIND, params.scaleFactor);
+
+    // '+' '-' roll, '&' '^' pitch, '/' '\\' yaw
+    const float angles[] = { params.zAngle, params.zAngle, params.xAngle, params.xAngle, params.yAngle, params.yAngle };
+    for (int kind = 0; kind < 6; kind++) {
+        kind_transforms[kind] = KindTransform(kind, angles[kind]);
+    }
+    kind_transforms[STEP_KIND] = step;
+
+    transforms.push_back(TurtleFrame());
+    run_children.push_back({});
+
+    // Single rotations are trie nodes 1 to 6, precompiled programs rely on this order
+    uint32_t rotations[6];
+    for (int kind = 0; kind < 6; kind++) {
+        rotations[kind] = FoldTransform(0, kind);
+    }
+    for (int c = 0; c < 256; c++) {
+        const int kind = TurtleSymbolKind(static_cast<char>(c));
+        symbol_kinds[c] = kind;
+        symbol_ops[c] = (kind >= 0) ? TurtleOp::Make(TurtleOpCode::Transform, rotations[kind])
+            : TurtleOp::Make(TurtleSymbolCode(static_cast<char>(c)));
+    }
+}
+
+void TurtleProgram::Load(const LSystemPrecompiledProgram& precompiled) {
+    // Nodes up to the single rotations already exist, the rest are folded in creation order
+    for (size_t node = transforms.size(); node < precompiled.nodeCount; node++) {
+        const LSystemPrecompiledNode& source = precompiled.nodes[node];
+        run_children[source.parent][source.kind] = AddTransform(transforms[source.parent] * kind_transforms[source.kind]);
+    }
+    ops.resize(precompiled.opCount);
+    for (size_t i = 0; i < precompiled.opCount; i++) {
+        ops[i].bits = precompiled.ops[i];
+    }
+}
+
+bool TurtleProgram::Export(std::vector<uint32_t>& opBits, std::vector<LSystemPrecompiledNode>& nodes) const {
+    // Every node but the root is the child of exactly one trie node
+    nodes.assign(transforms.size(), { 0, 0 });
+    std::vector<bool> linked(transforms.size(), false);
+    linked[0] = true;
+    for (size_t node = 0; node < run_children.size(); node++) {
+        for (int kind = 0; kind < TRANSFORM_KINDS; kind++) {
+            const uint32_t child = run_children[node][kind];
+            if (child != 0) {
+                nodes[child] = { static_cast<uint32_t>(node), static_cast<uint32_t>(kind) };
+                linked[child] = true;
+            }
+        }
+    }
+    if (std::find(linked.begin(), linked.end(), false) != linked.end()) return false;
+
+    opBits.resize(ops.size());
+    for (size_t i = 0; i < ops.size(); i++) {
+        opBits[i] = ops[i].bits;
+    }
+    return true;
+}
+
+TurtleFrame TurtleProgram::KindTransform(int kind, float value) const {
+    TurtleFrame transform;
+    if (kind == STEP_KIND) {
+        transform.position = glm::vec3(0.0f, value + 0.15f, 0.0f);
+        transform.scale = value;
+        return transform;
+    }
+
+    // Even kinds turn by +value, odd kinds by -value, about Z, X and Y in pairs
+    const glm::vec3 axes[] = { glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f) };
+    const float angle = (kind % 2 == 0) ? value : -value;
+    transform.rotation = glm::angleAxis(glm::radians(angle), axes[kind / 2]);
+    return transform;
+}
+
+uint32_t TurtleProgram::FoldTransform(uint32_t run, int kind) {
+    uint32_t child = run_children[run][kind];
+    if (child == 0) {
+        child = AddTransform(transforms[run] * kind_transforms[kind]);
+        run_children[run][kind] = child;
+    }
+    return child;
+}
+
+uint32_t TurtleProgram::AddTransform(const TurtleFrame& transform) {
+    // Every transform is also a trie node, so runs can keep folding from it
+    transforms.push_back(transform);
+    run_children.push_back({});
+    return static_cast<uint32_t>(transforms.size() - 1);
+}
+
+bool TurtleProgram::EmitIndexed(TurtleOpCode code, size_t index) {
+    if (index >= MAX_OPERAND) return false;
+    ops.push_back(TurtleOp::Make(code, static_cast<uint32_t>(index)));
+    return true;
+}
+
+bool TurtleProgram::Compile(const std::string& symbols) {
+    ops.reserve(ops.size() + symbols.size() / 2);
+
+    uint32_t run = 0;  // transform folded so far, 0 while nothing is pending
+    std::vector<size_t> open_pushes;
+    for (char c : symbols) {
+        const unsigned char symbol = static_cast<unsigned char>(c);
+        const int kind = symbol_kinds[symbol];
+        if (kind >= 0) {
+            run = FoldTransform(run, kind);
+            continue;
+        }
+
+        const TurtleOpCode code = symbol_ops[symbol].Code();
+        if (code == TurtleOpCode::Nop) continue;
+
+        if (run != 0) {
+            if (!EmitIndexed(TurtleOpCode::Transform, run)) return false;
+            run = 0;
+        }
+        if (code == TurtleOpCode::Forward) {
+            ops.push_back(TurtleOp::Make(TurtleOpCode::Branch));
+            run = FoldTransform(0, STEP_KIND);
+        }
+        else {
+            EmitSymbol(symbol, open_pushes);
+        }
+    }
+    // A trailing transform moves the turtle after its last emission and can be dropped
+
+    // Pushes that are never popped span the rest of the program
+    for (size_t push : open_pushes) {
+        LinkPush(push, ops.size());
+    }
+    return true;
+}
+
+bool TurtleProgram::Compile(const LSystemModuleString& modules) {
+    ops.reserve(ops.size() + modules.modules / 2);
+
+    // Runs without parameters are folded through the trie as above. Once a
+    // module with a parameter joins the run it is multiplied out in `pending`
+    // and stored as a transform of its own.
+    uint32_t run = 0;
+    bool literal = false;
+    TurtleFrame pending;
+    std::vector<size_t> open_pushes;
+
+    const std::vector<uint32_t>& words = modules.words;
+    for (size_t i = 0; i < words.size(); ) {
+        const unsigned char symbol = static_cast<unsigned char>(LSystemModuleString::Symbol(words[i]));
+        const int count = LSystemModuleString::Count(words[i]);
+        const float value = count > 0 ? LSystemModuleString::Value(words[i + 1]) : 0.0f;
+        const float width = count > 1 ? LSystemModuleString::Value(words[i + 2]) : 1.0f;
+        i += 1 + count;
+
+        const int kind = symbol_kinds[symbol];
+        if (kind >= 0) {
+            if (count > 0 || literal) {
+                if (!literal) {
+                    pending = transforms[run];
+                    literal = true;
+                }
+                pending = pending * (count > 0 ? KindTransform(kind, value) : kind_transforms[kind]);
+            }
+            else {
+                run = FoldTransform(run, kind);
+            }
+            continue;
+        }
+
+        const TurtleOpCode code = symbol_ops[symbol].Code();
+        if (code == TurtleOpCode::Nop) continue;
+
+        if (literal) {
+            if (!EmitIndexed(TurtleOpCode::Transform, AddTransform(pending))) return false;
+            literal = false;
+            run = 0;
+        }
+        else if (run != 0) {
+            if (!EmitIndexed(TurtleOpCode::Transform, run)) return false;
+            run = 0;
+        }
+        if (code == TurtleOpCode::Forward) {
+            if (count > 1) {
+                if (!EmitIndexed(TurtleOpCode::ScaledBranch, widths.size())) return false;
+                widths.push_back(width);
+            }
+            else {
+                ops.push_back(TurtleOp::Make(TurtleOpCode::Branch));
+            }
+            if (count > 0) {
+                pending = KindTransform(STEP_KIND, value);
+                literal = true;
+            }
+            else {
+                run = FoldTransform(0, STEP_KIND);
+            }
+        }
+        else {
+            EmitSymbol(symbol, open_pushes);
+        }
+    }
+
+    for (size_t push : open_pushes) {
+        LinkPush(push, ops.size());
+    }
+    return true;
+}
+
+void TurtleProgram::EmitSymbol(unsigned char symbol, std::vector<size_t>& open_pushes) {
+    const TurtleOpCode code = symbol_ops[symbol].Code();
+    if (code == TurtleOpCode::Push) {
+        open_pushes.push_back(ops.size());
+    }
+    else if (code == TurtleOpCode::Pop && !open_pushes.empty()) {
+        LinkPush(open_pushes.back(), ops.size());
+        open_pushes.pop_back();
+    }
+    ops.push_back(symbol_ops[symbol]);
+}
+
+void TurtleProgram::LinkPush(size_t push, size_t close) {
+    const size_t distance = close - push;
+    if (distance < MAX_PUSH_DISTANCE) {
+        ops[push] = TurtleOp::Make(TurtleOpCode::Push, static_cast<uint32_t>(distance));
+    }
+}
+
+bool LSystemInstanceGraph::Flatten(const glm::mat4& model, InstanceSink& branchTransforms,
+    InstanceSink& leafTransforms, const std::atomic<bool>* cancel) const {
+    if (groups.empty()) return true;
+
+    // The counts are exact, so the output is claimed once and written in place
+    const size_t branchStart = branchTransforms.size();
+    const size_t leafStart = leafTransforms.size();
+    AffineInstance* const firstBranch = branchTransforms.extend(groups[root].branchCount);
+    AffineInstance* const firstLeaf = leafTransforms.extend(groups[root].leafCount);
+    AffineInstance* branches = firstBranch;
+    AffineInstance* leaves = firstLeaf;
+    FlattenGroup(root, model, branches, leaves, cancel);
+    if (!(cancel && cancel->load(std::memory_order_relaxed))) return true;
+
+    // A cancelled walk stops part way, the slots it never reached are not handed out
+    branchTransforms.truncate(branchStart + static_cast<size_t>(branches - firstBranch));
+    leafTransforms.truncate(leafStart + static_cast<size_t>(leaves - firstLeaf));
+    return false;
+}
+
+void LSystemInstanceGraph::FlattenGroup(uint32_t group, const glm::mat4& model, AffineInstance*& branches,
+    AffineInstance*& leaves, const std::atomic<bool>* cancel) const {
+    if (cancel && cancel->load(std::memory_order_relaxed)) return;
+    const LSystemInstanceGroup& instance = groups[group];
+    for (const AffineInstance& branch : instance.branchTransforms) {
+        *branches++ = model * branch;
+    }
+    for (const AffineInstance& leaf : instance.leafTransforms) {
+        *leaves++ = model * leaf;
+    }
+    for (const LSystemGroupInstance& child : instance.children) {
+        FlattenGroup(child.group, model * child.frame.ToMat4(), branches, leaves, cancel);
+    }
+}
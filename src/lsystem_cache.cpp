@@ -0,0 +1,297 @@
+#include "lsystem_cache.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t entryCount;
+};
+
+const char CACHE_MAGIC[8] = { 'L', 'S', 'Y', 'S', 'P', 'R', 'O', 'G' };
+
+size_t alignUp(size_t offset) {
+    return (offset + 7) & ~size_t(7);
+}
+
+void appendBytes(std::string& key, const void* bytes, size_t count) {
+    key.append(static_cast<const char*>(bytes), count);
+}
+
+void appendString(std::string& key, const std::string& text) {
+    const uint64_t length = text.size();
+    appendBytes(key, &length, sizeof(length));
+    key += text;
+}
+
+// TurtleProgram::Load indexes its trie by every node and the turtle indexes it by every
+// Transform, so a damaged entry must not reach them: nodes only extend earlier nodes
+// and every operand stays within the entry. This reads the whole entry, so it is only
+// done for an entry about to be used or copied, never for the whole file at Open
+bool validProgram(const uint32_t* ops, size_t opCount, const LSystemPrecompiledNode* nodes, size_t nodeCount) {
+    if (nodeCount == 0) return false;
+    for (size_t node = 1; node < nodeCount; node++) {
+        if (nodes[node].parent >= node || nodes[node].kind >= static_cast<uint32_t>(TurtleProgram::TRANSFORM_KINDS)) return false;
+    }
+    for (size_t i = 0; i < opCount; i++) {
+        const TurtleOp op = { ops[i] };
+        switch (op.Code()) {
+        case TurtleOpCode::Transform:
+            if (op.Transform() >= nodeCount) return false;
+            break;
+        case TurtleOpCode::Push: {
+            // Pushes never closed are linked to the end of the program
+            const size_t close = i + op.PopDistance();
+            if (op.PopDistance() != 0 && (op.PopDistance() > opCount - i ||
+                (close < opCount && TurtleOp{ ops[close] }.Code() != TurtleOpCode::Pop))) return false;
+            break;
+        }
+        case TurtleOpCode::Nop:
+        case TurtleOpCode::Branch:
+        case TurtleOpCode::Forward:
+        case TurtleOpCode::MaybeForward:
+        case TurtleOpCode::Leaf:
+        case TurtleOpCode::Pop:
+            if (op.bits >> 4 != 0) return false;
+            break;
+        default:
+            // ScaledBranch needs widths, which only parametric programs have, and they are never stored
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+std::string LSystemProgramCache::Key(const LSystemGrammar& grammar, const std::unordered_map<char, LSystemRule>& rules) {
+    std::string key;
+    appendBytes(key, &VERSION, sizeof(VERSION));
+    appendString(key, grammar.axiom);
+
+    std::vector<char> symbols;
+    for (const auto& rule : rules) {
+        symbols.push_back(rule.first);
+    }
+    std::sort(symbols.begin(), symbols.end());
+    for (char symbol : symbols) {
+        const std::vector<LSystemProduction>& productions = rules.at(symbol).productions;
+        const uint64_t count = productions.size();
+        key += symbol;
+        appendBytes(key, &count, sizeof(count));
+        for (const LSystemProduction& production : productions) {
+            appendString(key, production.successor);
+            appendBytes(key, &production.weight, sizeof(production.weight));
+            appendString(key, production.left);
+            appendString(key, production.right);
+        }
+    }
+
+    // As in LSystemDerivationCache, these only change the derivation of some grammars
+    const int32_t seed = grammar.IsStochastic() ? grammar.seed : 0;
+    appendBytes(key, &seed, sizeof(seed));
+    appendString(key, grammar.IsContextSensitive() ? grammar.contextIgnored : std::string());
+    return key;
+}
+
+uint64_t LSystemProgramCache::Hash(const std::string& key) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+const LSystemProgramCache::Entry* LSystemProgramCache::Entries() const {
+    return file.IsOpen() ? reinterpret_cast<const Entry*>(file.Data() + sizeof(FileHeader)) : nullptr;
+}
+
+bool LSystemProgramCache::Validate() const {
+    const size_t size = file.Size();
+    if (size < sizeof(FileHeader)) return false;
+
+    FileHeader header;
+    std::memcpy(&header, file.Data(), sizeof(header));
+    if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != VERSION) return false;
+    if (header.entryCount > (size - sizeof(FileHeader)) / sizeof(Entry)) return false;
+
+    const Entry* entries = Entries();
+    for (uint64_t i = 0; i < header.entryCount; i++) {
+        const Entry& entry = entries[i];
+        const bool fits = entry.keyOffset <= size && entry.keyLength <= size - entry.keyOffset &&
+            entry.opOffset <= size && entry.opCount <= (size - entry.opOffset) / sizeof(uint32_t) &&
+            entry.nodeOffset <= size && entry.nodeCount <= (size - entry.nodeOffset) / sizeof(LSystemPrecompiledNode);
+        const bool aligned = entry.opOffset % 8 == 0 && entry.nodeOffset % 8 == 0;
+        const bool sorted = i == 0 || entries[i - 1].hash < entry.hash ||
+            (entries[i - 1].hash == entry.hash && entries[i - 1].depth < entry.depth);
+        if (!fits || !aligned || !sorted) return false;
+    }
+    return true;
+}
+
+bool LSystemProgramCache::Open(const std::string& path) {
+    this->path = path;
+    added.clear();
+    entryCount = 0;
+    if (!file.Open(path)) return true;
+
+    if (!Validate()) {
+        std::cerr << "L-system: ignoring program cache " << path << ", it is damaged or of another version" << std::endl;
+        file.Close();
+        return false;
+    }
+    FileHeader header;
+    std::memcpy(&header, file.Data(), sizeof(header));
+    entryCount = static_cast<size_t>(header.entryCount);
+    return true;
+}
+
+bool LSystemProgramCache::Find(const LSystemGrammar& grammar, const std::unordered_map<char, LSystemRule>& rules,
+    int depth, LSystemPrecompiledProgram& program) const {
+    if (entryCount == 0 && added.empty()) return false;
+
+    const std::string key = Key(grammar, rules);
+    const uint64_t hash = Hash(key);
+
+    const Entry* entries = Entries();
+    const Entry* end = entries + entryCount;
+    const Entry* entry = std::lower_bound(entries, end, std::make_pair(hash, static_cast<int64_t>(depth)),
+        [](const Entry& e, const std::pair<uint64_t, int64_t>& target) {
+            return e.hash < target.first || (e.hash == target.first && e.depth < target.second);
+        });
+    // The full key rules out hash collisions
+    if (entry != end && entry->hash == hash && entry->depth == depth && entry->keyLength == key.size() &&
+        std::memcmp(file.Data() + entry->keyOffset, key.data(), key.size()) == 0) {
+        program = { nullptr, depth,
+            reinterpret_cast<const uint32_t*>(file.Data() + entry->opOffset), static_cast<size_t>(entry->opCount),
+            reinterpret_cast<const LSystemPrecompiledNode*>(file.Data() + entry->nodeOffset), static_cast<size_t>(entry->nodeCount) };
+        // A damaged entry is a miss, the program compiled instead replaces it at the next Save
+        if (validProgram(program.ops, program.opCount, program.nodes, program.nodeCount)) return true;
+        std::cerr << "L-system: ignoring a damaged program in cache " << path << std::endl;
+    }
+
+    for (const AddedProgram& candidate : added) {
+        if (candidate.hash == hash && candidate.depth == depth && candidate.key == key) {
+            program = { nullptr, depth, candidate.ops.data(), candidate.ops.size(), candidate.nodes.data(), candidate.nodes.size() };
+            return true;
+        }
+    }
+    return false;
+}
+
+void LSystemProgramCache::Add(const LSystemGrammar& grammar, const std::unordered_map<char, LSystemRule>& rules,
+    int depth, const TurtleProgram& program) {
+    if (path.empty() || program.ops.size() > MAX_PROGRAM_OPS) return;
+
+    LSystemPrecompiledProgram existing;
+    if (Find(grammar, rules, depth, existing)) return;
+
+    AddedProgram entry;
+    // Programs with literal frames have no trie to store
+    if (!program.Export(entry.ops, entry.nodes)) return;
+    entry.key = Key(grammar, rules);
+    entry.hash = Hash(entry.key);
+    entry.depth = depth;
+    added.push_back(std::move(entry));
+}
+
+bool LSystemProgramCache::Save() {
+    if (added.empty() || path.empty()) return true;
+
+    // Every program, the mapped ones first, sorted by (hash, depth)
+    struct Source {
+        uint64_t hash;
+        int64_t depth;
+        const char* key;
+        size_t keyLength;
+        const uint32_t* ops;
+        size_t opCount;
+        const LSystemPrecompiledNode* nodes;
+        size_t nodeCount;
+    };
+    std::vector<Source> sources;
+    sources.reserve(Size());
+    const Entry* entries = Entries();
+    for (size_t i = 0; i < entryCount; i++) {
+        const Entry& entry = entries[i];
+        const Source source = { entry.hash, entry.depth,
+            reinterpret_cast<const char*>(file.Data() + entry.keyOffset), static_cast<size_t>(entry.keyLength),
+            reinterpret_cast<const uint32_t*>(file.Data() + entry.opOffset), static_cast<size_t>(entry.opCount),
+            reinterpret_cast<const LSystemPrecompiledNode*>(file.Data() + entry.nodeOffset), static_cast<size_t>(entry.nodeCount) };
+        // Every entry is read to be copied anyway, damaged ones are dropped
+        if (validProgram(source.ops, source.opCount, source.nodes, source.nodeCount)) {
+            sources.push_back(source);
+        }
+    }
+    for (const AddedProgram& program : added) {
+        sources.push_back({ program.hash, program.depth, program.key.data(), program.key.size(),
+            program.ops.data(), program.ops.size(), program.nodes.data(), program.nodes.size() });
+    }
+    std::stable_sort(sources.begin(), sources.end(), [](const Source& a, const Source& b) {
+        return a.hash < b.hash || (a.hash == b.hash && a.depth < b.depth);
+    });
+    // Two grammars with the same hash and depth: the first one keeps the slot
+    sources.erase(std::unique(sources.begin(), sources.end(), [](const Source& a, const Source& b) {
+        return a.hash == b.hash && a.depth == b.depth;
+    }), sources.end());
+
+    // Lay the file out in memory
+    size_t offset = sizeof(FileHeader) + sources.size() * sizeof(Entry);
+    std::vector<Entry> table(sources.size());
+    for (size_t i = 0; i < sources.size(); i++) {
+        const Source& source = sources[i];
+        Entry& entry = table[i];
+        entry = { source.hash, source.depth, 0, source.keyLength, 0, source.opCount, 0, source.nodeCount };
+        entry.keyOffset = offset;
+        offset = alignUp(offset + source.keyLength);
+        entry.opOffset = offset;
+        offset = alignUp(offset + source.opCount * sizeof(uint32_t));
+        entry.nodeOffset = offset;
+        offset = alignUp(offset + source.nodeCount * sizeof(LSystemPrecompiledNode));
+    }
+
+    std::vector<char> bytes(offset, 0);
+    FileHeader header = {};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = VERSION;
+    header.entryCount = sources.size();
+    std::memcpy(bytes.data(), &header, sizeof(header));
+    if (!table.empty()) {
+        std::memcpy(bytes.data() + sizeof(header), table.data(), table.size() * sizeof(Entry));
+    }
+    for (size_t i = 0; i < sources.size(); i++) {
+        std::memcpy(bytes.data() + table[i].keyOffset, sources[i].key, sources[i].keyLength);
+        std::memcpy(bytes.data() + table[i].opOffset, sources[i].ops, sources[i].opCount * sizeof(uint32_t));
+        std::memcpy(bytes.data() + table[i].nodeOffset, sources[i].nodes, sources[i].nodeCount * sizeof(LSystemPrecompiledNode));
+    }
+
+    // Written next to the cache and moved over it, so a failed write loses nothing
+    const std::string temporary = path + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out || !out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()))) {
+        std::cerr << "L-system: cannot write program cache " << temporary << std::endl;
+        return false;
+    }
+    out.close();
+
+    // The mapping has to go before its file can be replaced
+    file.Close();
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::cerr << "L-system: cannot replace program cache " << path << ": " << error.message() << std::endl;
+        std::vector<AddedProgram> unsaved = std::move(added);
+        Open(path);
+        added = std::move(unsaved);
+        return false;
+    }
+    return Open(path);
+}
@@ -0,0 +1,246 @@
+#include "lsystem_file.h"
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+static std::string trim(const std::string& text) {
+    size_t begin = 0;
+    size_t end = text.size();
+    while (begin < end && std::isspace(static_cast<unsigned char>(text[begin]))) begin++;
+    while (end > begin && std::isspace(static_cast<unsigned char>(text[end - 1]))) end--;
+    return text.substr(begin, end - begin);
+}
+
+static std::string removeSpaces(const std::string& text) {
+    std::string result;
+    for (char c : text) {
+        if (!std::isspace(static_cast<unsigned char>(c))) result.push_back(c);
+    }
+    return result;
+}
+
+static bool readNumbers(std::istringstream& line, float* values, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!(line >> values[i])) return false;
+    }
+    std::string rest;
+    return !(line >> rest);
+}
+
+// `[left <] P[(formal)] [> right] -> successor [: weight]`
+static bool parseRule(const std::string& text, LSystemParameters& params, std::string& error) {
+    const size_t arrow = text.find("->");
+    if (arrow == std::string::npos) {
+        error = "rule without '->'";
+        return false;
+    }
+    std::string head = text.substr(0, arrow);
+    std::string successor = text.substr(arrow + 2);
+
+    LSystemProduction production;
+    const size_t colon = successor.rfind(':');
+    if (colon != std::string::npos) {
+        std::istringstream weight(successor.substr(colon + 1));
+        std::string rest;
+        if (!(weight >> production.weight) || (weight >> rest) || production.weight <= 0.0f) {
+            error = "weight must be a positive number";
+            return false;
+        }
+        successor = successor.substr(0, colon);
+    }
+    production.successor = removeSpaces(successor);
+
+    const size_t less = head.find('<');
+    if (less != std::string::npos) {
+        production.left = removeSpaces(head.substr(0, less));
+        head = head.substr(less + 1);
+    }
+    const size_t greater = head.find('>');
+    if (greater != std::string::npos) {
+        production.right = removeSpaces(head.substr(greater + 1));
+        head = head.substr(0, greater);
+    }
+
+    const std::string predecessor = removeSpaces(head);
+    if (predecessor.empty()) {
+        error = "rule without a predecessor";
+        return false;
+    }
+    if (predecessor.size() > 1) {
+        if (predecessor[1] != '(' || predecessor.back() != ')') {
+            error = "predecessor must be one symbol, optionally with formal parameters";
+            return false;
+        }
+        const std::string formal = predecessor.substr(2, predecessor.size() - 3);
+        auto known = params.formalParameters.find(predecessor[0]);
+        if (known != params.formalParameters.end() && known->second != formal) {
+            error = std::string("conflicting formal parameters for '") + predecessor[0] + "'";
+            return false;
+        }
+        params.formalParameters[predecessor[0]] = formal;
+    }
+    params.rules[predecessor[0]].productions.push_back(production);
+    return true;
+}
+
+bool ParseLSystemGrammar(const std::string& text, LSystemParameters& params, std::string& error) {
+    LSystemParameters parsed = params;
+    parsed.rules.clear();
+    parsed.formalParameters.clear();
+    bool hasAxiom = false;
+
+    std::istringstream lines(text);
+    std::string raw;
+    for (int number = 1; std::getline(lines, raw); number++) {
+        const std::string content = trim(raw.substr(0, raw.find('#')));
+        if (content.empty()) continue;
+
+        std::istringstream line(content);
+        std::string directive;
+        line >> directive;
+        std::string rest;
+        std::getline(line, rest);
+        rest = trim(rest);
+        std::istringstream values(rest);
+
+        bool valid = true;
+        float numbers[3];
+        if (directive == "axiom") {
+            parsed.axiom = removeSpaces(rest);
+            hasAxiom = !parsed.axiom.empty();
+            valid = hasAxiom;
+        }
+        else if (directive == "rule") {
+            if (!parseRule(rest, parsed, error)) {
+                error = "line " + std::to_string(number) + ": " + error;
+                return false;
+            }
+        }
+        else if (directive == "ignore") {
+            parsed.contextIgnored = removeSpaces(rest);
+        }
+        else if (directive == "depth" || directive == "seed" || directive == "leafbudget") {
+            int value;
+            std::string extra;
+            valid = (values >> value) && !(values >> extra);
+            if (valid) {
+                (directive == "depth" ? parsed.depth : directive == "seed" ? parsed.seed : parsed.leafBudget) = value;
+            }
+        }
+        else if (directive == "scale") {
+            valid = readNumbers(values, &parsed.scaleFactor, 1);
+        }
+        else if (directive == "radius") {
+            valid = readNumbers(values, &parsed.branchRadius, 1);
+        }
+        else if (directive == "leaves" && (valid = readNumbers(values, numbers, 2))) {
+            parsed.minLeafCount = static_cast<int>(numbers[0]);
+            parsed.maxLeafCount = static_cast<int>(numbers[1]);
+        }
+        else if (directive == "angles" && (valid = readNumbers(values, numbers, 3))) {
+            parsed.xAngle = numbers[0];
+            parsed.yAngle = numbers[1];
+            parsed.zAngle = numbers[2];
+        }
+        else if (directive != "leaves" && directive != "angles") {
+            error = "line " + std::to_string(number) + ": unknown directive '" + directive + "'";
+            return false;
+        }
+
+        if (!valid) {
+            error = "line " + std::to_string(number) + ": bad value for '" + directive + "'";
+            return false;
+        }
+    }
+
+    if (!hasAxiom) {
+        error = "no axiom";
+        return false;
+    }
+    params = parsed;
+    return true;
+}
+
+std::string FormatLSystemGrammar(const LSystemParameters& params) {
+    std::ostringstream text;
+    // Enough digits that every float reads back as the same value
+    text << std::setprecision(std::numeric_limits<float>::max_digits10);
+    text << "axiom " << params.axiom << "\n"
+         << "depth " << params.depth << "\n"
+         << "scale " << params.scaleFactor << "\n"
+         << "radius " << params.branchRadius << "\n"
+         << "leaves " << params.minLeafCount << " " << params.maxLeafCount << "\n"
+         << "angles " << params.xAngle << " " << params.yAngle << " " << params.zAngle << "\n"
+         << "seed " << params.seed << "\n";
+    if (params.leafBudget != 0) {
+        text << "leafbudget " << params.leafBudget << "\n";
+    }
+    if (params.contextIgnored != LSYSTEM_CONTEXT_IGNORED) {
+        text << "ignore " << params.contextIgnored << "\n";
+    }
+
+    // Rules by symbol, so the same grammar always formats the same way
+    std::vector<char> symbols;
+    for (const auto& rule : params.rules) {
+        symbols.push_back(rule.first);
+    }
+    std::sort(symbols.begin(), symbols.end());
+    for (char symbol : symbols) {
+        const LSystemRule& rule = params.rules.at(symbol);
+        auto formal = params.formalParameters.find(symbol);
+        for (const LSystemProduction& production : rule.productions) {
+            text << "rule ";
+            if (!production.left.empty()) text << production.left << " < ";
+            text << symbol;
+            if (formal != params.formalParameters.end()) text << "(" << formal->second << ")";
+            if (!production.right.empty()) text << " > " << production.right;
+            text << " -> " << production.successor;
+            if (rule.productions.size() > 1 || production.weight != 1.0f) text << " : " << production.weight;
+            text << "\n";
+        }
+    }
+    return text.str();
+}
+
+bool LoadLSystemGrammar(const std::string& path, LSystemParameters& params) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "L-system: cannot open " << path << std::endl;
+        return false;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+
+    std::string error;
+    if (!ParseLSystemGrammar(text.str(), params, error)) {
+        std::cerr << "L-system: " << path << ": " << error << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool SaveLSystemGrammar(const std::string& path, const LSystemParameters& params) {
+    std::ofstream file(path);
+    if (!file || !(file << FormatLSystemGrammar(params))) {
+        std::cerr << "L-system: cannot write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::string> ListLSystemGrammars(const std::string& directory) {
+    std::vector<std::string> paths;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+        if (entry.is_regular_file() && entry.path().extension() == LSYSTEM_FILE_EXTENSION) {
+            paths.push_back(entry.path().string());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
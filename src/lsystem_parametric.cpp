@@ -0,0 +1,391 @@
+#include "lsystem_parametric.h"
+#include "counter_rng.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+
+// Recursive descent over
+//   sum     := product (('+' | '-') product)*
+//   product := unary (('*' | '/') unary)*
+//   unary   := ('-' | '+') unary | power
+//   power   := primary ('^' unary)?
+//   primary := number | name | '(' sum ')'
+// emitting postfix instructions and folding operators whose operands are constants.
+class LSystemExpressionParser {
+public:
+    LSystemExpressionParser(const std::string& source, const std::vector<std::string>& names,
+        std::vector<LSystemExpressionInstruction>& code)
+        : source(source), names(names), code(code) {}
+
+    bool parse(std::string& error) {
+        if (!sum()) {
+            error = message;
+            return false;
+        }
+        skipSpaces();
+        if (pos != source.size()) {
+            error = "unexpected '" + std::string(1, source[pos]) + "' in '" + source + "'";
+            return false;
+        }
+        return true;
+    }
+
+private:
+    bool sum() {
+        if (!product()) return false;
+        while (true) {
+            skipSpaces();
+            if (pos >= source.size() || (source[pos] != '+' && source[pos] != '-')) return true;
+            const LSystemExpressionOp op = source[pos++] == '+' ? LSystemExpressionOp::Add : LSystemExpressionOp::Subtract;
+            if (!product()) return false;
+            emitBinary(op);
+        }
+    }
+
+    bool product() {
+        if (!unary()) return false;
+        while (true) {
+            skipSpaces();
+            if (pos >= source.size() || (source[pos] != '*' && source[pos] != '/')) return true;
+            const LSystemExpressionOp op = source[pos++] == '*' ? LSystemExpressionOp::Multiply : LSystemExpressionOp::Divide;
+            if (!unary()) return false;
+            emitBinary(op);
+        }
+    }
+
+    bool unary() {
+        skipSpaces();
+        if (pos < source.size() && (source[pos] == '-' || source[pos] == '+')) {
+            const bool negate = source[pos++] == '-';
+            if (!unary()) return false;
+            if (negate) {
+                if (code.back().op == LSystemExpressionOp::Constant) {
+                    code.back().value = -code.back().value;
+                }
+                else {
+                    code.push_back({ LSystemExpressionOp::Negate, 0, 0.0f });
+                }
+            }
+            return true;
+        }
+        return power();
+    }
+
+    bool power() {
+        if (!primary()) return false;
+        skipSpaces();
+        if (pos < source.size() && source[pos] == '^') {
+            pos++;
+            if (!unary()) return false;
+            emitBinary(LSystemExpressionOp::Power);
+        }
+        return true;
+    }
+
+    bool primary() {
+        skipSpaces();
+        if (pos >= source.size()) return fail("expression '" + source + "' ends early");
+
+        const char c = source[pos];
+        if (c == '(') {
+            pos++;
+            if (!sum()) return false;
+            skipSpaces();
+            if (pos >= source.size() || source[pos] != ')') return fail("missing ')' in '" + source + "'");
+            pos++;
+            return true;
+        }
+        if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            const char* begin = source.c_str() + pos;
+            char* end = nullptr;
+            const float value = std::strtof(begin, &end);
+            pos += end - begin;
+            code.push_back({ LSystemExpressionOp::Constant, 0, value });
+            return true;
+        }
+        if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+            const size_t begin = pos;
+            while (pos < source.size() && (std::isalnum(static_cast<unsigned char>(source[pos])) || source[pos] == '_')) pos++;
+            const std::string name = source.substr(begin, pos - begin);
+            const auto found = std::find(names.begin(), names.end(), name);
+            if (found == names.end()) return fail("unknown parameter '" + name + "'");
+            code.push_back({ LSystemExpressionOp::Parameter, static_cast<uint32_t>(found - names.begin()), 0.0f });
+            return true;
+        }
+        return fail("unexpected '" + std::string(1, c) + "' in '" + source + "'");
+    }
+
+    void emitBinary(LSystemExpressionOp op) {
+        const size_t size = code.size();
+        if (code[size - 2].op != LSystemExpressionOp::Constant || code[size - 1].op != LSystemExpressionOp::Constant) {
+            code.push_back({ op, 0, 0.0f });
+            return;
+        }
+
+        // Both operands are known, replace them with the result
+        const float right = code.back().value;
+        code.pop_back();
+        code.back().value = evaluateConstant(op, code.back().value, right);
+    }
+
+    static float evaluateConstant(LSystemExpressionOp op, float a, float b) {
+        switch (op) {
+        case LSystemExpressionOp::Add: return a + b;
+        case LSystemExpressionOp::Subtract: return a - b;
+        case LSystemExpressionOp::Multiply: return a * b;
+        case LSystemExpressionOp::Divide: return a / b;
+        case LSystemExpressionOp::Power: return std::pow(a, b);
+        default: return a;
+        }
+    }
+
+    void skipSpaces() {
+        while (pos < source.size() && std::isspace(static_cast<unsigned char>(source[pos]))) pos++;
+    }
+
+    bool fail(const std::string& text) {
+        message = text;
+        return false;
+    }
+
+    const std::string& source;
+    const std::vector<std::string>& names;
+    std::vector<LSystemExpressionInstruction>& code;
+    size_t pos = 0;
+    std::string message;
+};
+
+bool LSystemExpression::Compile(const std::string& source, const std::vector<std::string>& names, std::string& error) {
+    code.clear();
+    LSystemExpressionParser parser(source, names, code);
+    if (!parser.parse(error)) return false;
+
+    // Deepest stack the bytecode needs
+    int depth = 0;
+    int maxDepth = 0;
+    for (const LSystemExpressionInstruction& instruction : code) {
+        if (instruction.op == LSystemExpressionOp::Constant || instruction.op == LSystemExpressionOp::Parameter) depth++;
+        else if (instruction.op != LSystemExpressionOp::Negate) depth--;
+        maxDepth = std::max(maxDepth, depth);
+    }
+    if (maxDepth > MAX_STACK) {
+        error = "expression '" + source + "' is nested too deeply";
+        return false;
+    }
+    return true;
+}
+
+float LSystemExpression::Power(float base, float exponent) {
+    return std::pow(base, exponent);
+}
+
+// Comma separated names, e.g. "l, w"
+static std::vector<std::string> splitNames(const std::string& list) {
+    std::vector<std::string> names;
+    std::string name;
+    for (char c : list) {
+        if (c == ',') {
+            names.push_back(name);
+            name.clear();
+        }
+        else if (!std::isspace(static_cast<unsigned char>(c))) {
+            name.push_back(c);
+        }
+    }
+    if (!name.empty() || !names.empty()) names.push_back(name);
+    return names;
+}
+
+LSystemParametricGrammar::LSystemParametricGrammar(const LSystemParameters& params) {
+    seed = params.seed;
+
+    // The axiom is a production without formal parameters, evaluated once
+    Production axiomProduction;
+    if (!Parse(params.axiom, {}, axiomProduction)) {
+        error = "axiom: " + error;
+        return;
+    }
+    for (const SuccessorModule& module : axiomProduction.modules) {
+        float values[LSystemModuleString::MAX_PARAMETERS];
+        for (uint32_t i = 0; i < module.count; i++) {
+            values[i] = axiomProduction.expressions[module.first_expression + i].Evaluate(nullptr);
+        }
+        axiom.Append(module.symbol, values, static_cast<int>(module.count));
+    }
+
+    for (const auto& entry : params.rules) {
+        const unsigned char symbol = static_cast<unsigned char>(entry.first);
+        const std::vector<LSystemProduction>& options = entry.second.productions;
+        if (options.empty()) continue;
+
+        std::vector<std::string> names;
+        const auto formals = params.formalParameters.find(entry.first);
+        if (formals != params.formalParameters.end()) {
+            names = splitNames(formals->second);
+        }
+        if (names.size() > LSystemModuleString::MAX_PARAMETERS) {
+            error = "rule '" + std::string(1, entry.first) + "': too many parameters";
+            return;
+        }
+
+        for (const LSystemProduction& option : options) {
+            if (!option.left.empty() || !option.right.empty()) {
+                error = "rule '" + std::string(1, entry.first) + "': context-sensitive rules need a grammar without parameters";
+                return;
+            }
+        }
+
+        Rule& rule = rules[symbol];
+        rule.arity = static_cast<int>(names.size());
+        float total = 0.0f;
+        for (const LSystemProduction& option : options) {
+            rule.productions.emplace_back();
+            if (!Parse(option.successor, names, rule.productions.back())) {
+                error = "rule '" + std::string(1, entry.first) + "': " + error;
+                return;
+            }
+            total += std::max(option.weight, 0.0f);
+            rule.cumulative_weights.push_back(total);
+        }
+        // Same fallback as LSystemGrammar: weights that are all zero pick the first production
+        if (rule.productions.size() == 1 || total <= 0.0f) rule.cumulative_weights.clear();
+    }
+
+    // A module its rule does not apply to would be rewritten by the symbol skeleton of
+    // LSystemGrammar::FromParameters all the same, so predictions and choices would differ
+    if (!CheckArity(axiomProduction, "axiom")) return;
+    for (int c = 0; c < 256; c++) {
+        for (const Production& production : rules[c].productions) {
+            if (!CheckArity(production, "rule '" + std::string(1, static_cast<char>(c)) + "'")) return;
+        }
+    }
+}
+
+bool LSystemParametricGrammar::CheckArity(const Production& production, const std::string& where) {
+    for (const SuccessorModule& module : production.modules) {
+        const Rule& rule = rules[static_cast<unsigned char>(module.symbol)];
+        if (rule.arity >= 0 && !rule.Applies(static_cast<int>(module.count))) {
+            error = where + ": module '" + std::string(1, module.symbol) + "' has " + std::to_string(module.count) +
+                " parameters, its rule takes " + std::to_string(rule.arity);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LSystemParametricGrammar::Parse(const std::string& source, const std::vector<std::string>& names, Production& production) {
+    size_t pos = 0;
+    while (pos < source.size()) {
+        const char symbol = source[pos++];
+        if (symbol == '(' || symbol == ')' || symbol == ',') {
+            error = "unexpected '" + std::string(1, symbol) + "' in '" + source + "'";
+            return false;
+        }
+
+        SuccessorModule module = { symbol, static_cast<uint32_t>(production.expressions.size()), 0 };
+        if (pos < source.size() && source[pos] == '(') {
+            // Split the argument list at commas outside nested parentheses
+            size_t begin = ++pos;
+            int nesting = 0;
+            while (true) {
+                if (pos >= source.size()) {
+                    error = "missing ')' in '" + source + "'";
+                    return false;
+                }
+                const char c = source[pos];
+                if (c == '(') nesting++;
+                else if (c == ')' && nesting > 0) nesting--;
+                else if ((c == ',' || c == ')') && nesting == 0) {
+                    production.expressions.emplace_back();
+                    if (!production.expressions.back().Compile(source.substr(begin, pos - begin), names, error)) return false;
+                    module.count++;
+                    begin = pos + 1;
+                    if (c == ')') break;
+                }
+                pos++;
+            }
+            pos++;
+            if (module.count > LSystemModuleString::MAX_PARAMETERS) {
+                error = "too many parameters in '" + source + "'";
+                return false;
+            }
+        }
+        production.modules.push_back(module);
+        production.words += 1 + module.count;
+    }
+    return true;
+}
+
+const LSystemParametricGrammar::Production& LSystemParametricGrammar::Choose(const Rule& rule, int generation, uint64_t index) const {
+    if (rule.cumulative_weights.empty()) return rule.productions[0];
+
+    // Same key and draw as LSystemGrammar::Choose
+    CounterRng rng(static_cast<uint32_t>(seed), index, static_cast<uint32_t>(generation) + 1);
+    const std::vector<float>& weights = rule.cumulative_weights;
+    const float pick = rng.NextFloat() * weights.back();
+    const size_t option = std::upper_bound(weights.begin(), weights.end(), pick) - weights.begin();
+    return rule.productions[std::min(option, weights.size() - 1)];
+}
+
+void LSystemParametricGrammar::Rewrite(const LSystemModuleString& current, LSystemModuleString& next, int generation) const {
+    const std::vector<uint32_t>& words = current.words;
+
+    // Productions have a fixed packed size, so the output is sized exactly before it is written
+    size_t size = 0;
+    size_t modules = 0;
+    uint64_t index = 0;
+    for (size_t i = 0; i < words.size(); index++) {
+        const int count = LSystemModuleString::Count(words[i]);
+        const Rule& rule = rules[static_cast<unsigned char>(LSystemModuleString::Symbol(words[i]))];
+        if (rule.Applies(count)) {
+            const Production& production = Choose(rule, generation, index);
+            size += production.words;
+            modules += production.modules.size();
+        }
+        else {
+            size += 1 + count;
+            modules++;
+        }
+        i += 1 + count;
+    }
+
+    next.words.resize(size);
+    next.modules = modules;
+    uint32_t* out = next.words.data();
+    float parameters[LSystemModuleString::MAX_PARAMETERS];
+    index = 0;
+    for (size_t i = 0; i < words.size(); index++) {
+        const int count = LSystemModuleString::Count(words[i]);
+        const Rule& rule = rules[static_cast<unsigned char>(LSystemModuleString::Symbol(words[i]))];
+        if (!rule.Applies(count)) {
+            // No rule for this module, copy it with its parameters
+            std::copy(words.begin() + i, words.begin() + i + 1 + count, out);
+            out += 1 + count;
+            i += 1 + count;
+            continue;
+        }
+
+        for (int p = 0; p < count; p++) {
+            parameters[p] = LSystemModuleString::Value(words[i + 1 + p]);
+        }
+        const Production& production = Choose(rule, generation, index);
+        for (const SuccessorModule& module : production.modules) {
+            *out++ = LSystemModuleString::Header(module.symbol, static_cast<int>(module.count));
+            for (uint32_t e = 0; e < module.count; e++) {
+                *out++ = LSystemModuleString::Word(production.expressions[module.first_expression + e].Evaluate(parameters));
+            }
+        }
+        i += 1 + count;
+    }
+}
+
+LSystemModuleString LSystemParametricGrammar::Expand(int depth, const std::atomic<bool>* cancel) const {
+    LSystemModuleString current = axiom;
+    LSystemModuleString next;
+    for (int i = 0; i < depth && !(cancel && cancel->load(std::memory_order_relaxed)); i++) {
+        Rewrite(current, next, i);
+        std::swap(current, next);
+    }
+    return current;
+}
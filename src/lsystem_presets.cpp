@@ -0,0 +1,53 @@
+#include "lsystem_presets.h"
+
+std::unordered_map<char, LSystemRule> LSystemPresetGrammar::Rules() const {
+    std::unordered_map<char, LSystemRule> result;
+    for (size_t i = 0; i < ruleCount; i++) {
+        result[rules[i].symbol] = rules[i].successor;
+    }
+    return result;
+}
+
+// Program of `Grammar` expanded `Depth` times, sized exactly by a first compile
+template <const LSystemPresetGrammar& Grammar, int Depth>
+struct LSystemPresetTable {
+    static constexpr size_t LENGTH = LSystemPresetExpandedLength(Grammar, Depth);
+    static constexpr LSystemPresetSize SIZE = MeasureLSystemPreset<LENGTH>(Grammar, Depth);
+    static constexpr LSystemPresetProgram<SIZE.ops, SIZE.nodes> PROGRAM = CompileLSystemPreset<SIZE.ops, SIZE.nodes>(Grammar, Depth);
+
+    static LSystemPrecompiledProgram View() {
+        return { &Grammar, Depth, PROGRAM.ops, PROGRAM.opCount, PROGRAM.nodes, PROGRAM.nodeCount };
+    }
+};
+
+static_assert(LSystemPresetTable<L_SYS_GRAMMAR_PLANT, 3>::LENGTH == 1073, "expanded length of the plant preset");
+
+// The depths the editor presets start at: Default, Dense Tree, Small Plant and Autumn Tree
+static const LSystemPrecompiledProgram PRECOMPILED_PROGRAMS[] = {
+    LSystemPresetTable<L_SYS_GRAMMAR_DEFAULT, 3>::View(),
+    LSystemPresetTable<L_SYS_GRAMMAR_DEFAULT, 4>::View(),
+    LSystemPresetTable<L_SYS_GRAMMAR_PLANT, 3>::View(),
+    LSystemPresetTable<L_SYS_GRAMMAR_AUTUMN, 4>::View()
+};
+
+static bool matchesGrammar(const LSystemParameters& params, const LSystemPresetGrammar& grammar) {
+    if (params.axiom != grammar.axiom || params.rules.size() != grammar.ruleCount || !params.formalParameters.empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < grammar.ruleCount; i++) {
+        auto rule = params.rules.find(grammar.rules[i].symbol);
+        if (rule == params.rules.end() || !(rule->second == LSystemRule(grammar.rules[i].successor))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const LSystemPrecompiledProgram* FindPrecompiledLSystem(const LSystemParameters& params) {
+    for (const LSystemPrecompiledProgram& program : PRECOMPILED_PROGRAMS) {
+        if (program.depth == params.depth && matchesGrammar(params, *program.grammar)) {
+            return &program;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,99 @@
+#include "lsystem_preview.h"
+#include <algorithm>
+
+LSystemPreview::~LSystemPreview() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        cancelled = true;
+        job++;
+    }
+    wake.notify_one();
+    if (worker.joinable()) worker.join();
+}
+
+void LSystemPreview::Start(const LSystemParameters& params, const std::vector<ForestPlacement>& placements) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->params = params;
+        this->placements = placements;
+        pending = !placements.empty();
+        hasFinished = false;
+        busy = pending;
+        cancelled = true;
+        job++;
+    }
+    if (!worker.joinable()) {
+        worker = std::thread(&LSystemPreview::Run, this);
+    }
+    wake.notify_one();
+}
+
+void LSystemPreview::Cancel() {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending = false;
+    hasFinished = false;
+    busy = false;
+    cancelled = true;
+    job++;
+}
+
+bool LSystemPreview::Poll(LSystemPreviewLevel& level) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!hasFinished) return false;
+    level = std::move(finished);
+    hasFinished = false;
+    return true;
+}
+
+void LSystemPreview::Run() {
+    // Generations derived for one level are the start of the next
+    LSystemDerivationCache cache;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || pending; });
+        if (stopping) return;
+        pending = false;
+        cancelled = false;
+        const uint64_t current = job;
+        const LSystemParameters requested = params;
+        const std::vector<ForestPlacement> trees = placements;
+        lock.unlock();
+
+        // Depths past the budgets would only grow the clamped tree again
+        const int target = LSystemGrammar::FromParameters(requested).ClampDepth(requested);
+        for (int depth = std::min(1, target); depth <= target && job == current; depth++) {
+            LSystemParameters sliced = requested;
+            sliced.depth = depth;
+
+            LSystemPreviewLevel level;
+            level.depth = depth;
+            int derived;
+            if (trees.size() == 1) {
+                glm::mat4 root = trees[0].root;
+                sliced.seed = trees[0].seed;
+                VectorInstanceSink branchSink(level.branchTransforms);
+                VectorInstanceSink leafSink(level.leafTransforms);
+                derived = Tree::createBranchesLSystem(root, branchSink, leafSink, sliced, &cache, &cancelled);
+            }
+            else {
+                ForestInstances forest;
+                derived = Tree::createForestLSystem(trees, sliced, forest, &cache, &cancelled);
+                level.branchTransforms.swap(forest.branchTransforms);
+                level.leafTransforms.swap(forest.leafTransforms);
+            }
+            // An invalid grammar, a dropped tree, or a forest whose per-tree budgets clamp it sooner
+            if (derived < depth) break;
+
+            std::lock_guard<std::mutex> publish(mutex);
+            if (job == current) {
+                finished = std::move(level);
+                hasFinished = true;
+            }
+        }
+
+        lock.lock();
+        if (job == current) busy = false;
+    }
+}
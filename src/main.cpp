@@ -14,10 +14,18 @@
 #include "renderer.h"
 #include "common_types.h"
 #include "tree_nodes.h"
+#include "lsystem.h"
+#include "lsystem_parametric.h"
+#include "lsystem_presets.h"
+#include "lsystem_file.h"
+#include "lsystem_cache.h"
+#include "lsystem_preview.h"
 #include <vector>
 #include <iostream> 
 #include <memory> 
 #include <variant>
+#include <random>
+#include <cmath>
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
@@ -26,9 +34,11 @@
 #define W_HEIGHT 900.0f
 
 #define SHADER_PATH(name) SHADER_DIR name
+#define GRAMMAR_PATH(name) GRAMMAR_DIR name
 #define BRANCH_LENGTH 0.2f
 #define ROOT_BRANCH_COUNT (int)7
 #define MAX_GROW (int)1000
+#define FOREST_SPACING 4.0f
 
 
 
@@ -37,19 +47,6 @@ enum class Mode {
     SpaceColonization
 };
 
-struct LSystemParameters {
-    int depth;
-    float scaleFactor;
-	float branchRadius;
-    int minLeafCount;
-    int maxLeafCount;
-	float xAngle;
-	float yAngle;
-	float zAngle;
-    std::string axiom;
-    std::unordered_map<char, std::string> rules;
-};
-
 struct SpaceColonizationParameters {
     float envelope_height;   // grow box height, determines the tree branch height
     float envelope_width;    // grow box width
@@ -64,21 +61,146 @@ int growthIteration = 0;
 bool grew = false;
 float growthTimer = 0.0f;
 float growthInterval = 0.1f;
+bool incrementalLinking = true;  // relink only the attraction points near the nodes grown last
 
 Mode mode = Mode::LSystem;  // Default mode
 bool showLeaves = true;
 bool showBranches = true;
 bool showAttractionPoints = false;
 bool hideReachedPoints = true;
+bool quantizedInstances = false;  // upload 32-byte PackedAffineInstance instead of 48-byte AffineInstance
 
 Camera* g_camera = nullptr;
 
+// Expanded L-system generations reused across regenerations
+LSystemDerivationCache derivationCache;
+// Compiled L-system programs reused across runs
+LSystemProgramCache programCache;
+
+// Text of the grammar editor, and the grammar it was last filled from. Until
+// it is edited the editor follows the parameters, presets included
+std::vector<char> grammarText(1, '\0');
+std::string grammarShown;
+std::vector<std::string> grammarFiles;
+char grammarName[64] = "my_tree";
+
+// L-system trees grown on a grid around the model, one seed each
+int forestSize = 1;
+ForestInstances forest;
+
+// Depths of the L-system tree shown one by one as a background thread grows them
+bool progressivePreview = false;
+LSystemPreview preview;
+LSystemParameters previewParams;  // parameters of the tree growing, edits to them start it again
+int previewForestSize = 0;        // and its number of trees
+int previewDepth = 0;             // depth on screen
+
+// Grammar of the Parameters panel and its predicted size, kept until the parameters change
+std::unique_ptr<LSystemGrammar> predictedGrammar;
+LSystemParameters predictedParams;
+LSystemSizePrediction predictedSize;
+std::string grammarError;
+int clampedDepth = 0;  // depth typed before the last clamp, 0 if it fit
+
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 
+// Where the generators write the instances of a mesh: straight into its mapped
+// instance buffer, or into `transforms` when quantized instances are packed on upload
+std::unique_ptr<InstanceSink> createInstanceSink(std::vector<AffineInstance>& transforms,
+    MeshRenderer::BufferObjects& buffers) {
+    if (quantizedInstances) {
+        return std::make_unique<VectorInstanceSink>(transforms);
+    }
+    return std::make_unique<MeshRenderer::MappedInstanceSink>(buffers);
+}
+
+// Send the transforms kept on the host to the meshes that draw them. Branches
+// and leaves only pass through the host when they are quantized
+void uploadTreeInstances(const std::vector<AffineInstance>& branchTransforms,
+    const std::vector<AffineInstance>& leafTransforms,
+    const std::vector<AffineInstance>& treeNodeTransforms,
+    MeshRenderer::BufferObjects& cylinderBuffers,
+    MeshRenderer::BufferObjects& leafBuffers,
+    MeshRenderer::BufferObjects& treeNodeBuffers) {
+    if (quantizedInstances) {
+        MeshRenderer::uploadInstances(cylinderBuffers, branchTransforms, quantizedInstances);
+        MeshRenderer::uploadInstances(leafBuffers, leafTransforms, quantizedInstances);
+    }
+    MeshRenderer::uploadInstances(treeNodeBuffers, treeNodeTransforms, quantizedInstances);
+}
+
+// Library of grammar files, a text editor for the current grammar and a way to
+// save it. True when `params` got a new grammar and the tree has to be regenerated
+bool showGrammarEditor(LSystemParameters& params) {
+    const std::string current = FormatLSystemGrammar(params);
+    if (current != grammarShown && grammarShown == grammarText.data()) {
+        grammarText.assign(std::max<size_t>(current.size() * 2, 4096), '\0');
+        std::copy(current.begin(), current.end(), grammarText.begin());
+        grammarShown = current;
+    }
+
+    bool changed = false;
+    static int selected = -1;
+    const char* preview = selected >= 0 ? grammarFiles[selected].c_str() : "Load grammar...";
+    if (ImGui::BeginCombo("Library", preview)) {
+        for (int i = 0; i < static_cast<int>(grammarFiles.size()); i++) {
+            if (ImGui::Selectable(grammarFiles[i].c_str(), i == selected) &&
+                LoadLSystemGrammar(grammarFiles[i], params)) {
+                selected = i;
+                changed = true;
+            }
+        }
+        ImGui::EndCombo();
+    }
+
+    ImGui::InputTextMultiline("##Grammar", grammarText.data(), grammarText.size(), ImVec2(-1.0f, ImGui::GetTextLineHeight() * 12));
+    // Parse errors share grammarError with the grammar checks of the Parameters panel, which shows it
+    if (ImGui::Button("Apply Grammar")) {
+        if (ParseLSystemGrammar(grammarText.data(), params, grammarError)) {
+            grammarError.clear();
+            changed = true;
+        }
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Revert")) {
+        grammarShown.clear();  // refilled from the parameters next frame
+        grammarText.assign(1, '\0');
+        grammarError.clear();
+    }
+
+    ImGui::InputText("Name", grammarName, sizeof(grammarName));
+    ImGui::SameLine();
+    if (ImGui::Button("Save")) {
+        if (SaveLSystemGrammar(std::string(GRAMMAR_DIR) + grammarName + LSYSTEM_FILE_EXTENSION, params)) {
+            grammarFiles = ListLSystemGrammars(GRAMMAR_DIR);
+            selected = -1;
+        }
+    }
+
+    // An applied grammar is the parameters' own text from now on
+    if (changed) {
+        grammarShown.clear();
+        grammarText.assign(1, '\0');
+    }
+    return changed;
+}
+
+// Roots of the forest, a grid of forestSize trees with consecutive seeds so every tree differs
+std::vector<ForestPlacement> forestPlacements(const glm::mat4& model, const LSystemParameters& params) {
+    std::vector<ForestPlacement> placements;
+    const int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(forestSize))));
+    for (int i = 0; i < forestSize; i++) {
+        const glm::vec3 offset((i % columns - (columns - 1) * 0.5f) * FOREST_SPACING, 0.0f,
+            (i / columns - (columns - 1) * 0.5f) * FOREST_SPACING);
+        placements.push_back({ glm::translate(model, offset), params.seed + i });
+    }
+    return placements;
+}
+
 void regenerateTree(Mode currentMode, Shader& shader,
-    std::vector<glm::mat4>& branchTransforms,
-    std::vector<glm::mat4>& leafTransforms,
-	std::vector<glm::mat4>& treeNodeTransforms,
+    std::vector<AffineInstance>& branchTransforms,
+    std::vector<AffineInstance>& leafTransforms,
+	std::vector<AffineInstance>& treeNodeTransforms,
 	AttractionPointManager& attractionPoints,
     TreeNodeManager& treeNodeManager,
     MeshRenderer::BufferObjects& cylinderBuffers,
@@ -92,13 +214,11 @@ void regenerateTree(Mode currentMode, Shader& shader,
     leafTransforms.clear();
 	treeNodeTransforms.clear();
 
-    // Delete old buffers
-    MeshRenderer::deleteBuffers(cylinderBuffers);
-    MeshRenderer::deleteBuffers(leafBuffers);
-	MeshRenderer::deleteBuffers(sphereBuffers);
-	MeshRenderer::deleteBuffers(treeNodeBuffers);
+    // The buffers are kept, so a mapped instance buffer is reused by the next sink.
+    // Only the cylinder and tree node meshes depend on the parameters
+    leafBuffers.instanceCount = 0;
+	sphereBuffers.instanceCount = 0;
 
-    // Create new buffers
     std::vector<float> cylinderVertices;
     std::vector<unsigned int> cylinderIndices;
     float branchLength = (currentMode == Mode::SpaceColonization) ? BRANCH_LENGTH : 1.0f;
@@ -109,27 +229,34 @@ void regenerateTree(Mode currentMode, Shader& shader,
     }
 
     Cylinder::create(cylinderVertices, cylinderIndices, branchRadius, branchLength, 8);
-    cylinderBuffers = MeshRenderer::createBuffers(cylinderVertices, cylinderIndices);
-
-    std::vector<float> leafVertices;
-    std::vector<unsigned int> leafIndices;
-    leaf::createLeaf(leafVertices, leafIndices);
-    leafBuffers = MeshRenderer::createBuffers(leafVertices, leafIndices);
-
-	std::vector<float> sphereVertices;
-	std::vector<unsigned int> sphereIndices;
-	Sphere::create(sphereVertices, sphereIndices, 0.03f, 12, 12);
-	sphereBuffers = MeshRenderer::createBuffers(sphereVertices, sphereIndices);
+    MeshRenderer::setMesh(cylinderBuffers, cylinderVertices, cylinderIndices);
 
     std::vector<float> treeNodeVertices;
     std::vector<unsigned int> treeNodeIndices;
     Sphere::create(treeNodeVertices, treeNodeIndices, branchRadius, 12, 12);
-    treeNodeBuffers = MeshRenderer::createBuffers(treeNodeVertices, treeNodeIndices);
+    MeshRenderer::setMesh(treeNodeBuffers, treeNodeVertices, treeNodeIndices);
 
     // Generate the tree
+    std::unique_ptr<InstanceSink> branchSink = createInstanceSink(branchTransforms, cylinderBuffers);
+    std::unique_ptr<InstanceSink> leafSink = createInstanceSink(leafTransforms, leafBuffers);
+    preview.Cancel();
     if (currentMode == Mode::LSystem) {
 		LSystemParameters params = std::get<LSystemParameters>(parameters);
-        Tree::createBranchesLSystem(model, branchTransforms, leafTransforms, params.axiom, params.rules, params.scaleFactor, branchRadius, params.depth, params.maxLeafCount, params.minLeafCount, params.xAngle, params.yAngle, params.zAngle);
+        if (progressivePreview) {
+            // Depths 1, 2, ... are uploaded as they are done, see the render loop
+            preview.Start(params, forestPlacements(model, params));
+            previewParams = params;
+            previewForestSize = forestSize;
+            previewDepth = 0;
+        }
+        else if (forestSize > 1) {
+            Tree::createForestLSystem(forestPlacements(model, params), params, forest, &derivationCache);
+            branchSink->append(forest.branchTransforms.data(), forest.branchTransforms.size());
+            leafSink->append(forest.leafTransforms.data(), forest.leafTransforms.size());
+        }
+        else {
+            Tree::createBranchesLSystem(model, *branchSink, *leafSink, params, &derivationCache);
+        }
     }
     else if (mode == Mode::SpaceColonization) {
         if (enableRealTimeGrowth) {
@@ -167,33 +294,35 @@ void regenerateTree(Mode currentMode, Shader& shader,
         // Generate tree nodes on the root branch
          treeNodeManager = TreeNodeManager(ROOT_BRANCH_COUNT);
         // First growth
-        attractionPoints.UpdateLinks(treeNodeManager, influenceRadius, 0.2f);
+        attractionPoints.UpdateLinks(treeNodeManager, influenceRadius, 0.2f, incrementalLinking);
 
         if (!enableRealTimeGrowth) {
 			int itr = 0;
 			bool grew = true;
             while (grew != false && itr < MAX_GROW) {
-                grew = treeNodeManager.GrowNewNodes(BRANCH_LENGTH);
-                attractionPoints.UpdateLinks(treeNodeManager, influenceRadius, 0.2f);
+                grew = treeNodeManager.GrowNewNodes(BRANCH_LENGTH, attractionPoints.attraction_points, attractionPoints.links);
+                attractionPoints.UpdateLinks(treeNodeManager, influenceRadius, 0.2f, incrementalLinking);
                 itr++;
             }
 
-            for (auto& node : treeNodeManager.tree_nodes) {
+            for (size_t i = 0; i < treeNodeManager.Size(); i++) {
                 glm::mat4 nodeModel = glm::mat4(1.0f);
-                nodeModel = glm::translate(nodeModel, node.position);
-                nodeModel = glm::scale(nodeModel, glm::vec3(node.radius + 0.02f));
-                treeNodeTransforms.push_back(nodeModel);
+                nodeModel = glm::translate(nodeModel, treeNodeManager.positions[i]);
+                nodeModel = glm::scale(nodeModel, glm::vec3(treeNodeManager.radii[i] + 0.02f));
+                treeNodeTransforms.emplace_back(nodeModel);
             }
         }
 
-        Tree::createBranchesSpaceColonization(treeNodeManager.tree_nodes, model, branchTransforms, leafTransforms, 0.1f, 0, ROOT_BRANCH_COUNT);
+        Tree::createBranchesSpaceColonization(treeNodeManager, model, *branchSink, *leafSink, 0.1f, 0, ROOT_BRANCH_COUNT);
     }
+    branchSink.reset();
+    leafSink.reset();
 
 
 
-    // Update shader settings for new mode
+    // Transforms are in world space, every mesh is drawn with one instanced call
+    uploadTreeInstances(branchTransforms, leafTransforms, treeNodeTransforms, cylinderBuffers, leafBuffers, treeNodeBuffers);
     shader.use();
-    shader.setMat4("model", model);
 }
 
 
@@ -208,6 +337,11 @@ int main() {
     // Set up callbacks
     glfwSetScrollCallback(window.getHandle(), scroll_callback);
 
+    // Grammar library, and the programs compiled from it in earlier runs
+    grammarFiles = ListLSystemGrammars(GRAMMAR_DIR);
+    programCache.Open(GRAMMAR_PATH("programs.lsyscache"));
+    derivationCache.programs = &programCache;
+
     // Create shader
     Shader shader(SHADER_PATH("vertex_shader.glsl"),
                   SHADER_PATH("fragment_shader.glsl"));
@@ -217,13 +351,13 @@ int main() {
     auto cylinderBuffers = MeshRenderer::createBuffers(cylinderVertices, cylinderIndices);
 
     // Generate branch transforms
-    std::vector<glm::mat4> branchTransforms;
+    std::vector<AffineInstance> branchTransforms;
     glm::vec3 treePosition(0.0f, 0.0f, 0.0f); // Example: moves tree to x=-2, z=1
     glm::mat4 model = glm::mat4(1.0f);
     model = glm::translate(model, treePosition);
     
 	// Generate tree node transforms
-    std::vector<glm::mat4> treeNodeTransforms;
+    std::vector<AffineInstance> treeNodeTransforms;
     glm::mat4 treeNodeModel = glm::mat4(1.0f);
     treeNodeModel = glm::translate(treeNodeModel, treePosition);
 
@@ -233,12 +367,13 @@ int main() {
 	leaf::createLeaf(leafVertices, leafIndices);
 	auto leafBuffers = MeshRenderer::createBuffers(leafVertices, leafIndices);
 	glm::mat4 leafModel = glm::mat4(1.0f);
-	std::vector<glm::mat4> leafTransforms;
+	std::vector<AffineInstance> leafTransforms;
 
 	// Generate sphere buffer
 	std::vector<float> sphereVertices;
 	std::vector<unsigned int> sphereIndices;
 	auto sphereBuffers = MeshRenderer::createBuffers(sphereVertices, sphereIndices);
+	std::vector<AffineInstance> pointTransforms;
 
 	// Generate tree node buffer
 	std::vector<float> treeNodeVertices;
@@ -260,13 +395,8 @@ int main() {
 			30.0f, // X Angle
 			73.0f, // Y Angle
 			20.0f, // Z Angle
-			"X", // Axiom
-            {
-                {'X', "F[//+XXL][+++YXL][-&^FXL][&FXL][\\^FXL][--^FXL][^&X]"},
-                {'F', "F[/+FL][-FL]"},
-                {'Y', "F[\\+&FYL][/-+F^YL][/&F^Y*L][\\^FYL][F++++YL]"},
-                {'L', "L[+L][-L][&L][^L]"}
-			} // Rules
+			L_SYS_GRAMMAR_DEFAULT.axiom, // Axiom
+			L_SYS_GRAMMAR_DEFAULT.Rules() // Rules, precompiled in lsystem_presets.cpp
     };
 
     LSystemParameters L_SYS_PRESET_PLANT = {
@@ -278,13 +408,8 @@ int main() {
 		60.0f, // X Angle
 		30.0f, // Y Angle
 		20.0f, // Z Angle
-		"X", // Axiom
-        {
-            {'X', "F[//+XXL][+++YXL][-&^FXL]"},
-            {'F', "F[/+FL][-FL]"},
-            {'Y', "F[\\+&FYL][/-+F^YL]"},
-            {'L', "L[+L][-L]"}
-		} // Rules
+		L_SYS_GRAMMAR_PLANT.axiom, // Axiom
+		L_SYS_GRAMMAR_PLANT.Rules() // Rules
     };
 
 	LSystemParameters L_SYS_PRESET_AUTUMN = {
@@ -296,11 +421,63 @@ int main() {
 		40.0f, // X Angle
 		30.0f, // Y Angle
 		20.0f, // Z Angle
+		L_SYS_GRAMMAR_AUTUMN.axiom, // Axiom
+		L_SYS_GRAMMAR_AUTUMN.Rules() // Rules
+	};
+
+	// Weighted alternatives per symbol, every seed grows a different tree
+	LSystemParameters L_SYS_PRESET_STOCHASTIC = {
+		4, // Depth
+		0.75f, // Scale Factor
+		12.0f, // Branch Radius
+		8, // Min Leaf Count
+		14, // Max Leaf Count
+		35.0f, // X Angle
+		60.0f, // Y Angle
+		25.0f, // Z Angle
 		"X", // Axiom
 		{
-			{'X', "F[//+XXL][&XL][\\^XL]"},
-			{'F', "F[F/+L][-FL]"},
-			{'Y', "[/&^Y*L][\\^YL][++++YL]"},
+			{'X', {{"F[//+XL][&XL][\\^XL]", 3.0f}, {"F[-&XL][+^XL]", 2.0f}, {"F[/XL]X", 1.0f}}},
+			{'F', {{"F[/+FL]", 1.0f}, {"F[-FL]", 1.0f}, {"F", 2.0f}}},
+			{'L', {{"L", 2.0f}, {"L[+L][-L]", 1.0f}}}
+		} // Rules
+	};
+
+	// Parametric modules: angles spread and branches thin out with every generation
+	LSystemParameters L_SYS_PRESET_PARAMETRIC = {
+		6, // Depth
+		0.8f, // Scale Factor
+		15.0f, // Branch Radius
+		6, // Min Leaf Count
+		10, // Max Leaf Count
+		30.0f, // X Angle
+		30.0f, // Y Angle
+		20.0f, // Z Angle
+		"A(20,1.2)", // Axiom
+		{
+			{'A', "F(0.85,w)[&(a)/(137)A(a*1.15,w*0.8)L][^(a*0.8)\\(90)A(a*1.1,w*0.75)L]/(60)A(a*0.9,w*0.9)"}
+		}, // Rules
+		{
+			{'A', "a,w"}
+		} // Formal Parameters
+	};
+
+	// Context-sensitive: a signal S climbs one internode A per generation and
+	// leaves a whorl behind, whose branches keep growing, so lower ones are longer
+	LSystemParameters L_SYS_PRESET_SIGNAL = {
+		12, // Depth
+		0.9f, // Scale Factor
+		15.0f, // Branch Radius
+		4, // Min Leaf Count
+		8, // Max Leaf Count
+		60.0f, // X Angle
+		137.5f, // Y Angle
+		30.0f, // Z Angle
+		"SAAAAAAAAAAAA", // Axiom
+		{
+			{'S', "F"},
+			{'A', {{"[&+FL][&-FL]/S", 1.0f, "S", ""}}}, // S < A -> [&+FL][&-FL]/S
+			{'L', {{"FL", 1.0f, "F", ""}}}               // F < L -> FL
 		} // Rules
 	};
 
@@ -388,47 +565,39 @@ int main() {
         shader.setInt("numLights", lightPositions.size());
         shader.setVec3("objectColor", treeColor);
 
+        // Swap in the deepest level the progressive preview finished since the last frame
+        LSystemPreviewLevel previewLevel;
+        if (preview.Poll(previewLevel)) {
+            branchTransforms.swap(previewLevel.branchTransforms);
+            leafTransforms.swap(previewLevel.leafTransforms);
+            MeshRenderer::uploadInstances(cylinderBuffers, branchTransforms, quantizedInstances);
+            MeshRenderer::uploadInstances(leafBuffers, leafTransforms, quantizedInstances);
+            previewDepth = previewLevel.depth;
+        }
+
         // Draw tree branches
         if (showBranches) {
-            glBindVertexArray(cylinderBuffers.VAO);
             shader.setVec3("objectColor", treeColor);
-            for (const auto& transform : branchTransforms) {
-                shader.setMat4("model", transform);
-                glDrawElements(GL_TRIANGLES, cylinderBuffers.indexCount, GL_UNSIGNED_INT, 0);
-            }
+            MeshRenderer::drawInstances(cylinderBuffers, shader);
         }
 
 		if (mode == Mode::SpaceColonization) {
             // Draw tree nodes
-            glBindVertexArray(treeNodeBuffers.VAO);
             shader.setVec3("objectColor", treeColor);
-            for (const auto& transform : treeNodeTransforms) {
-                shader.setMat4("model", transform);
-                glDrawElements(GL_TRIANGLES, treeNodeBuffers.indexCount, GL_UNSIGNED_INT, 0);
-            }
+            MeshRenderer::drawInstances(treeNodeBuffers, shader);
 
-            // Draw attraction points
+            // Draw attraction points, reached ones disappear while the tree grows
             if (showAttractionPoints) {
-                glBindVertexArray(sphereBuffers.VAO);
-                shader.setVec3("objectColor", pointColor);
-                if (hideReachedPoints) {
-                    for (const auto& point : attractionPoints.attraction_points) {
-                        if (point.reached) continue;
-
-                        glm::mat4 model = glm::mat4(1.0f);
-                        model = glm::translate(model, point.position);
-                        shader.setMat4("model", model);
-                        glDrawElements(GL_TRIANGLES, sphereBuffers.indexCount, GL_UNSIGNED_INT, 0);
-                    }
-                }
-                else {
-                    for (const auto& point : attractionPoints.attraction_points) {
-                        glm::mat4 model = glm::mat4(1.0f);
-                        model = glm::translate(model, point.position);
-                        shader.setMat4("model", model);
-                        glDrawElements(GL_TRIANGLES, sphereBuffers.indexCount, GL_UNSIGNED_INT, 0);
-                    }
+                pointTransforms.clear();
+                const AttractionPointStore& points = attractionPoints.attraction_points;
+                for (size_t i = 0; i < points.Size(); i++) {
+                    if (hideReachedPoints && points.Reached(i)) continue;
+
+                    pointTransforms.emplace_back(glm::translate(glm::mat4(1.0f), points.Position(i)));
                 }
+                MeshRenderer::uploadInstances(sphereBuffers, pointTransforms, quantizedInstances);
+                shader.setVec3("objectColor", pointColor);
+                MeshRenderer::drawInstances(sphereBuffers, shader);
             }
 		}
 
@@ -436,12 +605,8 @@ int main() {
 
         if (showLeaves) {
             //Draw Leaves
-            glBindVertexArray(leafBuffers.VAO);
             shader.setVec3("objectColor", leafColor);
-            for (const auto& transform : leafTransforms) {
-                shader.setMat4("model", transform);
-                glDrawElements(GL_TRIANGLES, leafBuffers.indexCount, GL_UNSIGNED_INT, 0);
-            }
+            MeshRenderer::drawInstances(leafBuffers, shader);
         }
 
 
@@ -463,28 +628,33 @@ int main() {
                 growthTimer = 0.0f; // Reset timer
 
                 if (growthIteration < MAX_GROW && grew) {
-                    grew = treeNodeManager.GrowNewNodes(BRANCH_LENGTH);
-                    attractionPoints.UpdateLinks(treeNodeManager, influenceRadius, 0.2f);
+                    grew = treeNodeManager.GrowNewNodes(BRANCH_LENGTH, attractionPoints.attraction_points, attractionPoints.links);
+                    attractionPoints.UpdateLinks(treeNodeManager, influenceRadius, 0.2f, incrementalLinking);
                     growthIteration++;
 
                     // Clear and regenerate branch transforms
                     branchTransforms.clear();
                     leafTransforms.clear();
-                    Tree::createBranchesSpaceColonization(treeNodeManager.tree_nodes, model,
-                        branchTransforms, leafTransforms, 0.1f, 0, ROOT_BRANCH_COUNT);
+                    {
+                        std::unique_ptr<InstanceSink> branchSink = createInstanceSink(branchTransforms, cylinderBuffers);
+                        std::unique_ptr<InstanceSink> leafSink = createInstanceSink(leafTransforms, leafBuffers);
+                        Tree::createBranchesSpaceColonization(treeNodeManager, model,
+                            *branchSink, *leafSink, 0.1f, 0, ROOT_BRANCH_COUNT);
+                    }
+
+                    treeNodeTransforms.clear();
+                    for (size_t i = 0; i < treeNodeManager.Size(); i++) {
+                        glm::mat4 nodeModel = glm::mat4(1.0f);
+                        nodeModel = glm::translate(nodeModel, treeNodeManager.positions[i]);
+                        nodeModel = glm::scale(nodeModel, glm::vec3(treeNodeManager.radii[i] + 0.02f));
+                        treeNodeTransforms.emplace_back(nodeModel);
+                    }
+                    uploadTreeInstances(branchTransforms, leafTransforms, treeNodeTransforms, cylinderBuffers, leafBuffers, treeNodeBuffers);
                 }
                 else {
                     isGrowing = false;
                 }
             }
-
-
-            for (auto& node : treeNodeManager.tree_nodes) {
-                glm::mat4 nodeModel = glm::mat4(1.0f);
-                nodeModel = glm::translate(nodeModel, node.position);
-                nodeModel = glm::scale(nodeModel, glm::vec3(node.radius + 0.02f));
-                treeNodeTransforms.push_back(nodeModel);
-            }
         }
       
         // Build ImGui UI
@@ -505,6 +675,10 @@ int main() {
             regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, parameters);
         }
 		ImGui::Checkbox("Show Leaves", &showLeaves);
+		if (ImGui::Checkbox("Quantized Instances", &quantizedInstances)) {
+			// Unquantized instances never reach the host, so the tree is generated again
+			regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, parameters);
+		}
         ImGui::End();
 
         ImGui::Begin("Parameters");
@@ -516,7 +690,58 @@ int main() {
 			ImGui::InputFloat("Branch Radius", &lParams.branchRadius);
 			ImGui::InputInt("Min Leaf Count", &lParams.minLeafCount);
 			ImGui::InputInt("Max Leaf Count", &lParams.maxLeafCount);
+			ImGui::InputInt("Leaf Budget (0 = off)", &lParams.leafBudget);
+			ImGui::Checkbox("Stream Derivation", &lParams.streamDerivation);
+			ImGui::Checkbox("Instance Subtrees", &lParams.instanceSubtrees);
+			ImGui::InputInt("Instance Budget", &lParams.maxInstances);
+			ImGui::InputInt("Memory Budget (MB)", &lParams.maxMemoryMB);
+			ImGui::InputInt("Seed", &lParams.seed);
+			ImGui::SameLine();
+			if (ImGui::Button("New Seed")) {
+				lParams.seed = static_cast<int>(std::random_device()() & 0x7FFFFFFF);
+				regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, lParams);
+			}
+			ImGui::SliderInt("Forest Trees", &forestSize, 1, 64);
+			if (ImGui::CollapsingHeader("Grammar") && showGrammarEditor(lParams)) {
+				regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, lParams);
+			}
+			if (ImGui::Checkbox("Progressive Preview", &progressivePreview) && progressivePreview) {
+				regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, lParams);
+			}
+			if (progressivePreview) {
+				ImGui::SameLine();
+				ImGui::Text(preview.Busy() ? "Depth %d, growing..." : "Depth %d", previewDepth);
+			}
+
+            // Predicted size of the requested depth, deeper trees than the budget allows are clamped
+            // first. Only an edit compiles the grammar and predicts again
+            if (!predictedGrammar || lParams != predictedParams) {
+                predictedGrammar = std::make_unique<LSystemGrammar>(LSystemGrammar::FromParameters(lParams));
+                grammarError.clear();
+                if (LSystemGrammar::IsParametric(lParams)) {
+                    LSystemParametricGrammar parametric(lParams);
+                    if (!parametric.Valid()) grammarError = parametric.Error();
+                }
+                const int maxDepth = predictedGrammar->ClampDepth(lParams);
+                clampedDepth = maxDepth < lParams.depth ? lParams.depth : 0;
+                lParams.depth = std::min(lParams.depth, maxDepth);
+                predictedSize = predictedGrammar->Predict(lParams.depth, lParams.maxLeafCount, lParams.leafBudget).back();
+                predictedParams = lParams;
+            }
+            if (!grammarError.empty()) {
+                ImGui::Text("Grammar error: %s", grammarError.c_str());
+            }
+            ImGui::Text("Symbols: %llu, Branches: <= %llu, Leaves: <= %llu",
+                (unsigned long long)predictedSize.symbols, (unsigned long long)predictedSize.branches, (unsigned long long)predictedSize.leaves);
+            if (clampedDepth != 0) {
+                ImGui::Text("Depth %d exceeds the budget, clamped to %d", clampedDepth, lParams.depth);
+            }
             parameters = lParams;
+
+            // The preview follows every edit, a tree still growing is dropped
+            if (progressivePreview && (lParams != previewParams || forestSize != previewForestSize)) {
+                regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, lParams);
+            }
         }
 
         // Space Colonization Parameters
@@ -532,6 +757,7 @@ int main() {
             ImGui::Checkbox("Show Attraction Points", &showAttractionPoints);
             ImGui::Separator();
 
+			ImGui::Checkbox("Incremental Linking", &incrementalLinking);
 			ImGui::Checkbox("Enable Real-Time Growth", &enableRealTimeGrowth);
 			if (enableRealTimeGrowth) {
                 ImGui::SliderFloat("Growth Speed", &growthInterval, 0.01f, 1.0f, "%.2f seconds");
@@ -580,6 +806,21 @@ int main() {
 				leafColor = glm::vec3(1.0f, 0.5f, 0.0f);
                 regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, lParams);
             }
+            else if (ImGui::Button("Stochastic Tree")) {
+				lParams = L_SYS_PRESET_STOCHASTIC;
+				leafColor = glm::vec3(0.0f, 1.0f, 0.0f);
+                regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, lParams);
+            }
+            else if (ImGui::Button("Parametric Tree")) {
+				lParams = L_SYS_PRESET_PARAMETRIC;
+				leafColor = glm::vec3(0.0f, 1.0f, 0.0f);
+                regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, lParams);
+            }
+            else if (ImGui::Button("Signal Conifer")) {
+				lParams = L_SYS_PRESET_SIGNAL;
+				leafColor = glm::vec3(0.0f, 1.0f, 0.0f);
+                regenerateTree(mode, shader, branchTransforms, leafTransforms, treeNodeTransforms, attractionPoints, treeNodeManager, cylinderBuffers, leafBuffers, sphereBuffers, treeNodeBuffers, model, lParams);
+            }
 			
 
         }
@@ -627,6 +868,7 @@ int main() {
 
     // Cleanup
     MeshRenderer::deleteBuffers(cylinderBuffers);
+    programCache.Save();
 
     // Camera will be automatically cleaned up when unique_ptr goes out of scope
     g_camera = nullptr;
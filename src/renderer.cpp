@@ -1,4 +1,19 @@
 #include "renderer.h"
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+
+// ARB_buffer_storage (core in GL 4.4), beyond the GL 3.3 loader
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRYP BufferStorageProc)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+// Smallest instance buffer a mapped sink allocates
+#define MIN_MAPPED_INSTANCES (size_t)1024
 
 MeshRenderer::BufferObjects MeshRenderer::createBuffers(
     const std::vector<float>& vertices,
@@ -37,6 +52,238 @@ MeshRenderer::BufferObjects MeshRenderer::createBuffers(
     return buffers;
 }
 
+void MeshRenderer::setMesh(BufferObjects& buffers, const std::vector<float>& vertices,
+    const std::vector<unsigned int>& indices) {
+    if (buffers.VAO == 0) {
+        // Keep an instance buffer made before the mesh
+        BufferObjects created = createBuffers(vertices, indices);
+        buffers.VAO = created.VAO;
+        buffers.VBO = created.VBO;
+        buffers.EBO = created.EBO;
+        buffers.indexCount = created.indexCount;
+        glBindVertexArray(0);
+    }
+    else {
+        // The VAO keeps pointing at VBO and EBO, only their data changes
+        buffers.indexCount = indices.size();
+        glBindVertexArray(buffers.VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.VBO);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float),
+            vertices.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int),
+            indices.data(), GL_STATIC_DRAW);
+        glBindVertexArray(0);
+    }
+    buffers.instanceCount = 0;
+}
+
+// Point the instance attributes, locations 2 to 5 of the vertex shader, at the
+// bound GL_ARRAY_BUFFER. The mesh's VAO must be bound
+static void setInstanceAttributes(bool quantized) {
+    if (quantized) {
+        const GLsizei stride = sizeof(PackedAffineInstance);
+        glVertexAttribPointer(2, 4, GL_HALF_FLOAT, GL_FALSE, stride, (void*)0);
+        glVertexAttribPointer(3, 4, GL_HALF_FLOAT, GL_FALSE, stride, (void*)(4 * sizeof(uint16_t)));
+        glVertexAttribPointer(4, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)(8 * sizeof(uint16_t)));
+        glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedAffineInstance, translation));
+        glEnableVertexAttribArray(5);
+        glVertexAttribDivisor(5, 1);
+    }
+    else {
+        const GLsizei stride = sizeof(AffineInstance);
+        for (int row = 0; row < 3; row++) {
+            glVertexAttribPointer(2 + row, 4, GL_FLOAT, GL_FALSE, stride, (void*)(row * sizeof(glm::vec4)));
+        }
+        glDisableVertexAttribArray(5);
+    }
+    for (int location = 2; location < 5; location++) {
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
+}
+
+// glBufferStorage of the current context, nullptr without ARB_buffer_storage
+static BufferStorageProc bufferStorage() {
+    static const BufferStorageProc proc = glfwExtensionSupported("GL_ARB_buffer_storage")
+        ? reinterpret_cast<BufferStorageProc>(glfwGetProcAddress("glBufferStorage")) : nullptr;
+    return proc;
+}
+
+void MeshRenderer::uploadInstances(BufferObjects& buffers, const std::vector<AffineInstance>& instances,
+    bool quantized) {
+    if (buffers.instanceMap != nullptr) {
+        // Storage of a persistent mapping is immutable, start over with a plain buffer
+        if (buffers.instanceFence != nullptr) {
+            glDeleteSync(buffers.instanceFence);
+            buffers.instanceFence = nullptr;
+        }
+        glDeleteBuffers(1, &buffers.instanceVBO);
+        buffers.instanceVBO = 0;
+        buffers.instanceMap = nullptr;
+        buffers.instanceCapacity = 0;
+    }
+    if (buffers.instanceVBO == 0) {
+        glGenBuffers(1, &buffers.instanceVBO);
+    }
+    buffers.instanceCount = instances.size();
+    buffers.quantized = quantized;
+
+    glBindVertexArray(buffers.VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.instanceVBO);
+    if (quantized) {
+        std::vector<PackedAffineInstance> packed(instances.begin(), instances.end());
+        glBufferData(GL_ARRAY_BUFFER, packed.size() * sizeof(PackedAffineInstance),
+            packed.data(), GL_DYNAMIC_DRAW);
+    }
+    else {
+        glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(AffineInstance),
+            instances.data(), GL_DYNAMIC_DRAW);
+    }
+    setInstanceAttributes(quantized);
+    glBindVertexArray(0);
+}
+
+MeshRenderer::MappedInstanceSink::MappedInstanceSink(BufferObjects& buffers) : buffers(buffers) {
+    if (buffers.instanceMap != nullptr) {
+        // The GPU may still draw the previous instances from the mapping, wait for the last
+        // draw from this buffer before overwriting them. Other work in flight goes on
+        if (buffers.instanceFence != nullptr) {
+            GLenum status = glClientWaitSync(buffers.instanceFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            while (status == GL_TIMEOUT_EXPIRED) {
+                status = glClientWaitSync(buffers.instanceFence, 0, 1000000000);
+            }
+            glDeleteSync(buffers.instanceFence);
+            buffers.instanceFence = nullptr;
+        }
+        mapped = buffers.instanceMap;
+        capacity = buffers.instanceCapacity;
+        persistent = true;
+    }
+    buffers.instanceCount = 0;
+}
+
+MeshRenderer::MappedInstanceSink::~MappedInstanceSink() {
+    finish();
+}
+
+void MeshRenderer::MappedInstanceSink::reserve(size_t more) {
+    if (count + more > capacity) {
+        grow(count + more);
+    }
+}
+
+AffineInstance* MeshRenderer::MappedInstanceSink::extend(size_t more) {
+    reserve(more);
+    AffineInstance* first = mapped + count;
+    count += more;
+    return first;
+}
+
+void MeshRenderer::MappedInstanceSink::grow(size_t needed) {
+    const size_t newCapacity = std::max({ needed, 2 * capacity, MIN_MAPPED_INSTANCES });
+    if (onHost) {
+        hostInstances.resize(newCapacity);
+        mapped = hostInstances.data();
+        capacity = newCapacity;
+        return;
+    }
+    const GLsizeiptr bytes = static_cast<GLsizeiptr>(newCapacity * sizeof(AffineInstance));
+    BufferStorageProc storage = bufferStorage();
+
+    unsigned int buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    if (storage) {
+        storage(GL_ARRAY_BUFFER, bytes, nullptr, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    }
+    else {
+        glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_DYNAMIC_DRAW);
+    }
+
+    if (buffers.instanceVBO != 0) {
+        // Instances written so far are copied on the GPU, mapped memory is slow to read back
+        glBindBuffer(GL_COPY_READ_BUFFER, buffers.instanceVBO);
+        if (count > 0) {
+            if (!persistent) {
+                glUnmapBuffer(GL_COPY_READ_BUFFER);
+            }
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, 0, 0,
+                static_cast<GLsizeiptr>(count * sizeof(AffineInstance)));
+        }
+        glDeleteBuffers(1, &buffers.instanceVBO);
+    }
+    buffers.instanceVBO = buffer;
+
+    // Without the copy, a plain mapping can drop the old contents
+    GLbitfield access = GL_MAP_WRITE_BIT;
+    if (storage) access |= GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    else if (count == 0) access |= GL_MAP_INVALIDATE_BUFFER_BIT;
+    mapped = static_cast<AffineInstance*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, access));
+    if (mapped == nullptr) {
+        // Out of address space or a driver that refuses the mapping, fall back to a host
+        // copy uploaded by finish. Instances written so far are read back once
+        std::cerr << "MeshRenderer: cannot map an instance buffer of " << bytes
+            << " bytes, uploading the instances instead" << std::endl;
+        hostInstances.resize(newCapacity);
+        if (count > 0) {
+            glGetBufferSubData(GL_ARRAY_BUFFER, 0, static_cast<GLsizeiptr>(count * sizeof(AffineInstance)),
+                hostInstances.data());
+        }
+        mapped = hostInstances.data();
+        onHost = true;
+        storage = nullptr;
+    }
+    capacity = newCapacity;
+    persistent = storage != nullptr;
+    buffers.instanceMap = persistent ? mapped : nullptr;
+    buffers.instanceCapacity = persistent ? capacity : 0;
+}
+
+void MeshRenderer::MappedInstanceSink::finish() {
+    if (finished) return;
+    finished = true;
+
+    buffers.instanceCount = count;
+    buffers.quantized = false;
+    if (buffers.instanceVBO == 0) return;
+
+    glBindVertexArray(buffers.VAO);
+    if (onHost) {
+        // The buffer may have immutable storage, upload to a plain one
+        glDeleteBuffers(1, &buffers.instanceVBO);
+        glGenBuffers(1, &buffers.instanceVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.instanceVBO);
+        glBufferData(GL_ARRAY_BUFFER, count * sizeof(AffineInstance), hostInstances.data(), GL_DYNAMIC_DRAW);
+        hostInstances = std::vector<AffineInstance>();
+    }
+    else {
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.instanceVBO);
+        if (!persistent && mapped != nullptr) {
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+    }
+    setInstanceAttributes(false);
+    glBindVertexArray(0);
+}
+
+void MeshRenderer::drawInstances(BufferObjects& buffers, const Shader& shader) {
+    if (buffers.instanceCount == 0) return;
+
+    shader.setInt("quantizedInstances", buffers.quantized);
+    glBindVertexArray(buffers.VAO);
+    glDrawElementsInstanced(GL_TRIANGLES, static_cast<GLsizei>(buffers.indexCount), GL_UNSIGNED_INT, 0,
+        static_cast<GLsizei>(buffers.instanceCount));
+
+    if (buffers.instanceMap != nullptr) {
+        // Only the latest draw matters, it completes after the earlier ones
+        if (buffers.instanceFence != nullptr) {
+            glDeleteSync(buffers.instanceFence);
+        }
+        buffers.instanceFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
+
 void MeshRenderer::deleteBuffers(BufferObjects& buffers) {
     if (buffers.VAO != 0) {
         glDeleteVertexArrays(1, &buffers.VAO);
@@ -45,4 +292,16 @@ void MeshRenderer::deleteBuffers(BufferObjects& buffers) {
         buffers.VAO = buffers.VBO = buffers.EBO = 0;
         buffers.indexCount = 0;
     }
+    if (buffers.instanceVBO != 0) {
+        // Deleting the buffer also ends a persistent mapping
+        if (buffers.instanceFence != nullptr) {
+            glDeleteSync(buffers.instanceFence);
+            buffers.instanceFence = nullptr;
+        }
+        glDeleteBuffers(1, &buffers.instanceVBO);
+        buffers.instanceVBO = 0;
+        buffers.instanceCount = 0;
+        buffers.instanceMap = nullptr;
+        buffers.instanceCapacity = 0;
+    }
 }
\ No newline at end of file
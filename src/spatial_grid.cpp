@@ -0,0 +1,181 @@
+#include "spatial_grid.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPATIAL_GRID_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Points tested per instruction by FindNearest
+#if defined(__AVX2__)
+#define GRID_LANES 8
+#elif defined(SPATIAL_GRID_SSE2)
+#define GRID_LANES 4
+#else
+#define GRID_LANES 1
+#endif
+
+void SpatialGrid::Build(const float* x, const float* y, const float* z, size_t count, float cell_size) {
+    indices.resize(count);
+    // The last vector load of a row may run past the last point, the lanes it reads are masked
+    xs.resize(count + GRID_LANES - 1, 0.0f);
+    ys.resize(count + GRID_LANES - 1, 0.0f);
+    zs.resize(count + GRID_LANES - 1, 0.0f);
+    point_cells.resize(count);
+    if (count == 0) {
+        dimensions = glm::ivec3(0);
+        cell_starts.assign(1, 0);
+        return;
+    }
+
+    glm::vec3 lower(x[0], y[0], z[0]);
+    glm::vec3 upper = lower;
+    for (size_t i = 0; i < count; i++) {
+        const glm::vec3 point(x[i], y[i], z[i]);
+        lower = glm::min(lower, point);
+        upper = glm::max(upper, point);
+    }
+
+    // Wider cells keep a sparse, spread-out set from allocating a huge grid;
+    // queries stay correct since a cell only has to be as wide as the radius
+    const size_t max_cells = 8 * count + 64;
+    const glm::vec3 extent = upper - lower;
+    for (;;) {
+        this->cell_size = cell_size;
+        inverse_cell_size = 1.0f / cell_size;
+        origin = Cell(lower);
+        dimensions = Cell(upper) - origin + 1;
+        const double cells = static_cast<double>(dimensions.x) * dimensions.y * dimensions.z;
+        if (cells <= static_cast<double>(max_cells)) break;
+        cell_size = std::max(cell_size * 2.0f, std::cbrt(extent.x * extent.y * extent.z / static_cast<float>(max_cells)));
+    }
+
+    // Count the points of every cell, shifted by one so the prefix sum yields the starts
+    const size_t cells = static_cast<size_t>(dimensions.x) * dimensions.y * dimensions.z;
+    cell_starts.assign(cells + 1, 0);
+    for (size_t i = 0; i < count; i++) {
+        const glm::ivec3 cell = Cell(glm::vec3(x[i], y[i], z[i])) - origin;
+        const uint32_t id = static_cast<uint32_t>((static_cast<size_t>(cell.z) * dimensions.y + cell.y) * dimensions.x + cell.x);
+        point_cells[i] = id;
+        cell_starts[id + 1]++;
+    }
+    for (size_t cell = 0; cell < cells; cell++) {
+        cell_starts[cell + 1] += cell_starts[cell];
+    }
+
+    // Scatter in point order, so every cell lists its points by index. The
+    // counts are consumed back to zero by advancing each cell's start...
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t entry = cell_starts[point_cells[i]]++;
+        indices[entry] = static_cast<uint32_t>(i);
+        xs[entry] = x[i];
+        ys[entry] = y[i];
+        zs[entry] = z[i];
+    }
+    // ...which leaves every start at the next cell's, shift them back
+    for (size_t cell = cells; cell > 0; cell--) {
+        cell_starts[cell] = cell_starts[cell - 1];
+    }
+    cell_starts[0] = 0;
+}
+
+bool SpatialGrid::FindNearest(const glm::vec3& position, uint32_t& index, float& distance_sq) const {
+    if (indices.empty()) return false;
+
+    const glm::ivec3 low = glm::max(Cell(position) - 1 - origin, glm::ivec3(0));
+    const glm::ivec3 high = glm::min(Cell(position) + 1 - origin, dimensions - 1);
+    if (glm::any(glm::greaterThan(low, high))) return false;
+
+    // Every lane keeps the closest entry it has seen, only a strictly closer one replaces it
+    float lane_distances[GRID_LANES];
+    int32_t lane_entries[GRID_LANES];
+#if defined(__AVX2__)
+    const __m256 px = _mm256_set1_ps(position.x);
+    const __m256 py = _mm256_set1_ps(position.y);
+    const __m256 pz = _mm256_set1_ps(position.z);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 best_distances = _mm256_set1_ps(FLT_MAX);
+    __m256i best_entries = _mm256_set1_epi32(-1);
+#elif defined(SPATIAL_GRID_SSE2)
+    const __m128 px = _mm_set1_ps(position.x);
+    const __m128 py = _mm_set1_ps(position.y);
+    const __m128 pz = _mm_set1_ps(position.z);
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    __m128 best_distances = _mm_set1_ps(FLT_MAX);
+    __m128i best_entries = _mm_set1_epi32(-1);
+#else
+    lane_distances[0] = FLT_MAX;
+    lane_entries[0] = -1;
+#endif
+
+    for (int z = low.z; z <= high.z; z++) {
+        for (int y = low.y; y <= high.y; y++) {
+            const size_t row = (static_cast<size_t>(z) * dimensions.y + y) * dimensions.x;
+            const uint32_t end = cell_starts[row + high.x + 1];
+#if defined(__AVX2__)
+            const __m256i row_end = _mm256_set1_epi32(static_cast<int32_t>(end));
+            for (uint32_t entry = cell_starts[row + low.x]; entry < end; entry += 8) {
+                const __m256i entries = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int32_t>(entry)), lane);
+                const __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(xs.data() + entry), px);
+                const __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(ys.data() + entry), py);
+                const __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(zs.data() + entry), pz);
+                const __m256 distances = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+                // Lanes past the end of the row belong to other cells
+                const __m256 closer = _mm256_and_ps(_mm256_cmp_ps(distances, best_distances, _CMP_LT_OQ),
+                    _mm256_castsi256_ps(_mm256_cmpgt_epi32(row_end, entries)));
+                best_distances = _mm256_blendv_ps(best_distances, distances, closer);
+                best_entries = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_entries), _mm256_castsi256_ps(entries), closer));
+            }
+#elif defined(SPATIAL_GRID_SSE2)
+            const __m128i row_end = _mm_set1_epi32(static_cast<int32_t>(end));
+            for (uint32_t entry = cell_starts[row + low.x]; entry < end; entry += 4) {
+                const __m128i entries = _mm_add_epi32(_mm_set1_epi32(static_cast<int32_t>(entry)), lane);
+                const __m128 dx = _mm_sub_ps(_mm_loadu_ps(xs.data() + entry), px);
+                const __m128 dy = _mm_sub_ps(_mm_loadu_ps(ys.data() + entry), py);
+                const __m128 dz = _mm_sub_ps(_mm_loadu_ps(zs.data() + entry), pz);
+                const __m128 distances = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                const __m128 closer = _mm_and_ps(_mm_cmplt_ps(distances, best_distances),
+                    _mm_castsi128_ps(_mm_cmplt_epi32(entries, row_end)));
+                best_distances = _mm_or_ps(_mm_and_ps(closer, distances), _mm_andnot_ps(closer, best_distances));
+                best_entries = _mm_or_si128(_mm_and_si128(_mm_castps_si128(closer), entries),
+                    _mm_andnot_si128(_mm_castps_si128(closer), best_entries));
+            }
+#else
+            for (uint32_t entry = cell_starts[row + low.x]; entry < end; entry++) {
+                const glm::vec3 diff = position - glm::vec3(xs[entry], ys[entry], zs[entry]);
+                const float distance = glm::dot(diff, diff);
+                if (distance < lane_distances[0]) {
+                    lane_distances[0] = distance;
+                    lane_entries[0] = static_cast<int32_t>(entry);
+                }
+            }
+#endif
+        }
+    }
+
+#if defined(__AVX2__)
+    _mm256_storeu_ps(lane_distances, best_distances);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lane_entries), best_entries);
+#elif defined(SPATIAL_GRID_SSE2)
+    _mm_storeu_ps(lane_distances, best_distances);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lane_entries), best_entries);
+#endif
+
+    // Rows are scanned in entry order, so among equally close lanes the lowest entry came first
+    int32_t best = -1;
+    for (int i = 0; i < GRID_LANES; i++) {
+        if (lane_entries[i] < 0) continue;
+        if (best < 0 || lane_distances[i] < distance_sq || (lane_distances[i] == distance_sq && lane_entries[i] < best)) {
+            best = lane_entries[i];
+            distance_sq = lane_distances[i];
+        }
+    }
+    if (best < 0) return false;
+    index = indices[best];
+    return true;
+}
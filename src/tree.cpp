@@ -2,6 +2,12 @@
 #include "tree_nodes.h"
 #include "common_types.h"
 #include "cylinder.h"
+#include "lsystem.h"
+#include "lsystem_parametric.h"
+#include "lsystem_presets.h"
+#include "lsystem_cache.h"
+#include "leaf_batch.h"
+#include "counter_rng.h"
 #include <glm/glm.hpp>
 #include <gtc/matrix_transform.hpp>
 #include <stack>
@@ -12,15 +18,21 @@
 #include <cstdlib>  // For randomization
 #include <ctime>    // For seeding randomness
 #include <random>
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/quaternion.hpp>
 #include "renderer.h"
 
-void Tree::createBranches(glm::mat4& model, std::vector<glm::mat4>& branchTransforms,
+void Tree::createBranches(glm::mat4& model, std::vector<AffineInstance>& branchTransforms,
     float length, float radius, int depth) {
     if (depth <= 0) return;
 
-    branchTransforms.push_back(model);
+    branchTransforms.emplace_back(model);
 
     glm::mat4 rightBranch = model;
     rightBranch = glm::translate(rightBranch, glm::vec3(0.0f, length, 0.0f));
@@ -36,166 +48,640 @@ void Tree::createBranches(glm::mat4& model, std::vector<glm::mat4>& branchTransf
 }
 
 
-void generateLeafTransforms(const glm::mat4& currentModel,
-    std::vector<glm::mat4>& leafTransforms,
-    float scale, int num_leaves, bool translate) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> disRotate(-120, 120);
-    std::uniform_real_distribution<> disTranslate(-0.4f, 0.4f);
+// Turtle that executes compiled L-system instructions. Symbols can also be fed
+// one at a time, straight from a streaming derivation. The state is a compact
+// frame relative to the tree model, expanded to a matrix only when an
+// instance is emitted.
+// Every random instruction ('X', 'Y' and 'L') is a site numbered in program
+// order, and its draws are keyed by (seed, site, domain). Turtles that start
+// at the right site therefore reproduce a serial walk exactly.
+// Leaf clusters are only recorded as sites, the caller generates them in one
+// batch with generateLeafBatch.
+class LSystemTurtle {
+public:
+    LSystemTurtle(const glm::mat4& model, InstanceSink& branchTransforms,
+        std::vector<LeafSite>& leafSites, const LSystemParameters& params, const TurtleProgram& program,
+        uint32_t domain = 0)
+        : model(model), branchTransforms(&branchTransforms), leafSites(&leafSites), program(program),
+        seed(static_cast<uint32_t>(params.seed)), domain(domain), minLeafCount(params.minLeafCount),
+        maxLeafCount(params.maxLeafCount), scaleFactor(params.scaleFactor) {}
+
+    void interpret(char c) {
+        execute(program.SymbolOp(c));
+    }
 
+    void execute(TurtleOp op) {
+        switch (op.Code()) {
+        case TurtleOpCode::Transform:
+            // Folded run of rotations and steps
+            current = current * program.transforms[op.Transform()];
+            break;
 
-    for (int i = 0; i < num_leaves; i++) {
-        float random_angle = disRotate(gen);
-        // float scaleFactor = disScale(gen);
-		float translateX = disTranslate(gen);
-		float translateY = disTranslate(gen);
-		float translateZ = disTranslate(gen);
+        case TurtleOpCode::Branch:
+            branchTransforms->append(AffineInstance(currentModel()));
+            break;
 
-        glm::mat4 leafModel = currentModel;
+        case TurtleOpCode::ScaledBranch: {
+            const float width = program.widths[op.Width()];
+            branchTransforms->append(AffineInstance(currentModel() * glm::scale(glm::mat4(1.0f), glm::vec3(width, 1.0f, width))));
+            break;
+        }
 
-        leafModel = glm::scale(leafModel, glm::vec3(scale, scale, scale));
-        // Apply random rotations around different axes
-        leafModel = glm::rotate(leafModel, glm::radians(random_angle), glm::vec3(0.0f, 0.0f, 1.0f));
-        leafModel = glm::rotate(leafModel, glm::radians(random_angle), glm::vec3(1.0f, 0.0f, 0.0f));
-        leafModel = glm::rotate(leafModel, glm::radians(random_angle), glm::vec3(0.0f, 1.0f, 0.0f));
+        case TurtleOpCode::Forward:
+            branchTransforms->append(AffineInstance(currentModel()));
+            current = current * program.step;
+            break;
 
-        if (translate) {
-            leafModel = glm::translate(leafModel, glm::vec3(translateX, translateY, 0));
+        case TurtleOpCode::MaybeForward: {
+            // Generate branches based on 'X' or 'Y'
+            CounterRng rng(seed, site++, domain);
+            if ((rng.NextUInt() & 1u) != 0) {
+                branchTransforms->append(AffineInstance(currentModel()));
+                current = current * program.step;
+            }
+            break;
         }
 
-        leafTransforms.push_back(leafModel);
+        case TurtleOpCode::Push:
+            // Save the current turtle state to the stack
+            frameStack.push_back(current);
+            break;
+
+        case TurtleOpCode::Pop:
+            // Restore the last saved turtle state from the stack
+            if (!frameStack.empty()) {
+                current = frameStack.back();
+                frameStack.pop_back();
+            }
+            break;
+
+        case TurtleOpCode::Leaf: {
+            // Draws 0 and 1 pick the cluster size and scale, the leaves draw from 2 on
+            CounterRng rng(seed, site, domain);
+            const int num_leaves = std::max(rng.UniformInt(minLeafCount, maxLeafCount), 0);
+            const float scale = rng.Uniform(0.5f, scaleFactor);
+            leafSites->push_back({ currentModel(), site, seed, domain, 2, static_cast<uint32_t>(num_leaves), scale, true });
+            site++;
+            break;
+        }
+        default:
+            // Ignore any other symbols
+            break;
+        }
+    }
+
+    const TurtleFrame& frame() const { return current; }
+    size_t stackDepth() const { return frameStack.size(); }
+    uint64_t nextSite() const { return site; }
+
+    // Random instructions consume one site each
+    static bool isRandom(TurtleOp op) {
+        return op.Code() == TurtleOpCode::MaybeForward || op.Code() == TurtleOpCode::Leaf;
+    }
+
+    // Apply the net transform of a subtree interpreted elsewhere
+    void advance(const TurtleFrame& transform) { current = current * transform; }
+
+    // Continue from `frame` at random site `firstSite` with an empty stack, emitting into other buffers
+    void restart(const TurtleFrame& frame, uint64_t firstSite, InstanceSink& branches,
+        std::vector<LeafSite>& leaves) {
+        current = frame;
+        site = firstSite;
+        frameStack.clear();
+        branchTransforms = &branches;
+        leafSites = &leaves;
     }
+
+private:
+    glm::mat4 currentModel() const { return model * current.ToMat4(); }
+
+    // Stack to handle branching points
+    std::vector<TurtleFrame> frameStack;
+    TurtleFrame current;
+    const glm::mat4 model;
+
+    InstanceSink* branchTransforms;
+    std::vector<LeafSite>* leafSites;
+    const TurtleProgram& program;
+
+    const uint32_t seed;
+    const uint32_t domain;
+    uint64_t site = 0;  // number of random instructions executed so far
+    const int minLeafCount;
+    const int maxLeafCount;
+    const float scaleFactor;
+};
+
+// Programs shorter than this are executed on the calling thread
+#define PARALLEL_INTERPRET_MIN_OPS (size_t)65536
+// Instructions executed between two looks at the cancel flag
+#define CANCEL_CHECK_OPS (size_t)65536
+
+// Another thread asked for the tree still growing to be dropped
+static bool cancelled(const std::atomic<bool>* cancel) {
+    return cancel && cancel->load(std::memory_order_relaxed);
 }
 
-void Tree::createBranchesLSystem(glm::mat4 &model, std::vector<glm::mat4> &branchTransforms,
-                                 std::vector<glm::mat4> &leafTransforms, const std::string &axiom,
-                                 const std::unordered_map<char, std::string> &rules,
-                                 float length, float radius, int depth, int maxLeafCount, int minLeafCount, float xAngle, float yAngle, float zAngle)
-{
+// Execute ops [begin, end), false if `cancel` stopped it on the way
+static bool executeLSystemOps(LSystemTurtle& turtle, const TurtleProgram& program, size_t begin, size_t end,
+    const std::atomic<bool>* cancel) {
+    while (begin < end) {
+        if (cancelled(cancel)) return false;
+        const size_t blockEnd = std::min(end, begin + CANCEL_CHECK_OPS);
+        for (size_t k = begin; k < blockEnd; k++) {
+            turtle.execute(program.ops[k]);
+        }
+        begin = blockEnd;
+    }
+    return true;
+}
+
+// Contiguous piece of the compiled program together with the turtle state at
+// its start. Bracketed blocks restore the turtle when they close, so once
+// their entry state is known they can be interpreted independently.
+struct LSystemSegment {
+    size_t begin;
+    size_t end;
+    TurtleFrame entryFrame;
+    uint64_t firstSite;  // random site of the first random instruction
+    bool interpreted;
+    std::vector<AffineInstance> branchTransforms{};
+    std::vector<LeafSite> leafSites{};
+};
+
+// Index of the Pop closing the Push at `open`, or `end` if it is never closed
+static size_t matchBracket(const std::vector<TurtleOp>& ops, size_t open, size_t end) {
+    // The compiler links most pushes to their pop, only very long blocks need a scan
+    const size_t distance = ops[open].PopDistance();
+    if (distance != 0) {
+        return std::min(open + distance, end);
+    }
+
+    int nesting = 0;
+    for (size_t i = open; i < end; i++) {
+        const TurtleOpCode code = ops[i].Code();
+        if (code == TurtleOpCode::Push) nesting++;
+        else if (code == TurtleOpCode::Pop && --nesting == 0) return i;
+    }
+    return end;
+}
 
-    const float angleZ = zAngle; // For '+' and '-'
-    const float angleX = xAngle; // For '&' and '^'
-    const float angleY = yAngle; // For '/' and '\\'
-
-    // Apply the L-system rules to expand the axiom string
-    std::string current = axiom;
-    for (int i = 0; i < depth; ++i) {
-        std::string next;
-        for (char c : current) {
-            if (rules.find(c) != rules.end()) {
-                next += rules.at(c);  // Apply the rule if it exists
+// Split [begin, end) into bracketed blocks that can be interpreted in parallel.
+// The instructions between blocks decide the entry state of the next block, so they
+// are interpreted here in order; blocks larger than `grain` are split again.
+static void splitLSystemRange(const TurtleProgram& program, size_t begin, size_t end,
+    const glm::mat4& model, size_t grain, const LSystemParameters& params,
+    std::vector<LSystemSegment>& segments) {
+    const std::vector<TurtleOp>& ops = program.ops;
+
+    // Enclosing ranges to resume once a large block has been split; a block
+    // leaves the turtle as it found it, so its entry state is the resume state
+    struct Resume {
+        size_t next;
+        size_t end;
+        TurtleFrame frame;
+    };
+    std::vector<Resume> resume;
+
+    std::vector<AffineInstance> unusedBranches;
+    VectorInstanceSink unusedSink(unusedBranches);
+    std::vector<LeafSite> unusedLeaves;
+    LSystemTurtle turtle(model, unusedSink, unusedLeaves, params, program);
+    TurtleFrame frame;
+    uint64_t site = 0;
+    size_t i = begin;
+    while (true) {
+        if (i >= end) {
+            if (resume.empty()) break;
+            i = resume.back().next;
+            end = resume.back().end;
+            frame = resume.back().frame;
+            resume.pop_back();
+            continue;
+        }
+
+        size_t runEnd = i;
+        while (runEnd < end && ops[runEnd].Code() != TurtleOpCode::Push) runEnd++;
+
+        if (runEnd > i) {
+            segments.push_back({ i, runEnd, frame, site, true });
+            LSystemSegment& run = segments.back();
+            VectorInstanceSink runBranches(run.branchTransforms);
+            turtle.restart(frame, site, runBranches, run.leafSites);
+            for (size_t k = i; k < runEnd; k++) {
+                turtle.execute(ops[k]);
             }
-            else {
-                next += c;  // Keep the character unchanged if there's no rule
+            frame = turtle.frame();
+            site = turtle.nextSite();
+        }
+        if (runEnd == end) {
+            i = end;
+            continue;
+        }
+
+        size_t close = matchBracket(ops, runEnd, end);
+        if (close - runEnd - 1 > grain) {
+            resume.push_back({ close + 1, end, frame });
+            end = close;
+        }
+        else {
+            segments.push_back({ runEnd + 1, close, frame, site, false });
+            // The block is interpreted later, only its random sites are numbered now
+            for (size_t k = runEnd + 1; k < close; k++) {
+                site += LSystemTurtle::isRandom(ops[k]);
             }
+            i = close + 1;
+            continue;
         }
-        current = next;
+        i = runEnd + 1;
     }
+}
 
-    // Stack to handle branching points
-    std::stack<glm::mat4> transformStack;
-    glm::mat4 currentModel = model;
-
-    
-
-    for (char c : current) {
-        std::random_device rd;  // Seed the random number generator
-        std::mt19937 gen(rd()); // Mersenne Twister engine
-        std::uniform_int_distribution<> disNumLeaves(minLeafCount,maxLeafCount); // Uniform distribution between 0 and 20
-        std::uniform_int_distribution<> disRotate(-120, 120); // Rotation between 0 and 120 degrees
-        std::uniform_real_distribution<> disScale(0.5f, length); // Scale between 0.5 and 1.5
-        //std::uniform_real_distribution<> disTranslate(-0.4f, 0.4f);
-		std::uniform_int_distribution<> disBranch(0,1);
-        int num_leaves = disNumLeaves(gen);
-		int gen_branch = disBranch(gen);
-        float scale = disScale(gen);
-        switch (c) {
-        case 'F':
-            branchTransforms.push_back(currentModel);
-            currentModel = glm::translate(currentModel, glm::vec3(0.0f, length+0.15f, 0.0f));
-            currentModel = glm::scale(currentModel, glm::vec3(length, length, length));
-            break;
+// Execute the compiled program on all cores. Output order is the same as a
+// single turtle walking the program from start to end. False if `cancel` stopped it
+static bool interpretLSystemParallel(const glm::mat4& model, InstanceSink& branchTransforms,
+    std::vector<LeafSite>& leafSites, const TurtleProgram& program, const LSystemParameters& params,
+    const std::atomic<bool>* cancel) {
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    const size_t grain = std::max(program.ops.size() / (threads * 8), (size_t)4096);
+
+    std::vector<LSystemSegment> segments;
+    splitLSystemRange(program, 0, program.ops.size(), model, grain, params, segments);
+
+    const long long segmentCount = static_cast<long long>(segments.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (long long s = 0; s < segmentCount; s++) {
+        LSystemSegment& segment = segments[s];
+        if (segment.interpreted) continue;
+
+        VectorInstanceSink branches(segment.branchTransforms);
+        LSystemTurtle turtle(model, branches, segment.leafSites, params, program);
+        turtle.restart(segment.entryFrame, segment.firstSite, branches, segment.leafSites);
+        executeLSystemOps(turtle, program, segment.begin, segment.end, cancel);
+    }
+    if (cancelled(cancel)) return false;
+
+    // Offsets of every segment's slice in the final output
+    std::vector<size_t> branchOffsets(segments.size() + 1, 0);
+    std::vector<size_t> siteOffsets(segments.size() + 1, leafSites.size());
+    for (size_t s = 0; s < segments.size(); s++) {
+        branchOffsets[s + 1] = branchOffsets[s] + segments[s].branchTransforms.size();
+        siteOffsets[s + 1] = siteOffsets[s] + segments[s].leafSites.size();
+    }
+    AffineInstance* branches = branchTransforms.extend(branchOffsets.back());
+    leafSites.resize(siteOffsets.back());
 
-        case 'X':
-        case 'Y':
-            if (gen_branch != 0) {
-            // Generate branches based on 'X' or 'Y'
-            branchTransforms.push_back(currentModel);
-            currentModel = glm::translate(currentModel, glm::vec3(0.0f, length+0.15f, 0.0f));
-            currentModel = glm::scale(currentModel, glm::vec3(length, length, length));
+    #pragma omp parallel for schedule(dynamic)
+    for (long long s = 0; s < segmentCount; s++) {
+        std::copy(segments[s].branchTransforms.begin(), segments[s].branchTransforms.end(), branches + branchOffsets[s]);
+        std::copy(segments[s].leafSites.begin(), segments[s].leafSites.end(), leafSites.begin() + siteOffsets[s]);
+    }
+    return true;
+}
+
+// Builds the instance graph of a derivation, one group per (symbol, generations left) pair
+class LSystemInstancer {
+public:
+    LSystemInstancer(const LSystemGrammar& grammar, const TurtleProgram& program,
+        const LSystemParameters& params, LSystemInstanceGraph& graph)
+        : grammar(grammar), program(program), params(params), graph(graph),
+        memo((std::max(params.depth, 0) + 1) * 256, NO_GROUP) {}
+
+    // Group for `symbols` when each of them has `remaining` generations left.
+    // Fails when a subtree pops a state it did not push, its geometry then
+    // depends on where it is placed and cannot be shared.
+    // Random draws of a group come from its own domain, keyed by its memo slot.
+    bool build(const std::string& symbols, int remaining, bool root, uint32_t slot, uint32_t& group) {
+        LSystemInstanceGroup result;
+        VectorInstanceSink branches(result.branchTransforms);
+        std::vector<LeafSite> leafSites;
+        LSystemTurtle turtle(glm::mat4(1.0f), branches, leafSites, params, program,
+            GROUP_DOMAIN + slot);
+
+        for (char c : symbols) {
+            if (remaining > 0 && grammar.HasRule(c)) {
+                uint32_t child;
+                if (!symbolGroup(c, remaining, child)) return false;
+                result.children.push_back({ child, turtle.frame() });
+                turtle.advance(graph.groups[child].exit);
+                continue;
             }
-            break;
 
-        case '+':
-            // Roll right around Z-axis
-            currentModel = glm::rotate(currentModel, glm::radians(angleZ), glm::vec3(0.0f, 0.0f, 1.0f));
-            break;
+            const TurtleOp op = program.SymbolOp(c);
+            if (!root && op.Code() == TurtleOpCode::Pop && turtle.stackDepth() == 0) return false;
+            turtle.execute(op);
+        }
+        if (!root && turtle.stackDepth() != 0) return false;
+
+        VectorInstanceSink leaves(result.leafTransforms);
+        generateLeafBatch(leafSites, leaves);
+        result.exit = turtle.frame();
+        result.branchCount = result.branchTransforms.size();
+        result.leafCount = result.leafTransforms.size();
+        for (const LSystemGroupInstance& child : result.children) {
+            result.branchCount += graph.groups[child.group].branchCount;
+            result.leafCount += graph.groups[child.group].leafCount;
+        }
 
-        case '-':
-            // Roll left around Z-axis
-            currentModel = glm::rotate(currentModel, glm::radians(-angleZ), glm::vec3(0.0f, 0.0f, 1.0f));
-            break;
+        group = static_cast<uint32_t>(graph.groups.size());
+        graph.groups.push_back(std::move(result));
+        return true;
+    }
 
-        case '&':
-            // Pitch down around X-axis
-            currentModel = glm::rotate(currentModel, glm::radians(angleX), glm::vec3(1.0f, 0.0f, 0.0f));
-            break;
+    // Slot past the memo table, so the root draws from a domain of its own
+    uint32_t rootSlot() const { return static_cast<uint32_t>(memo.size()); }
+
+private:
+    bool symbolGroup(char c, int remaining, uint32_t& group) {
+        const uint32_t slot = static_cast<uint32_t>(remaining * 256 + static_cast<unsigned char>(c));
+        uint32_t& cached = memo[slot];
+        if (cached == NO_GROUP) {
+            // Every copy of the group shares one stochastic choice, keyed by the symbol
+            const std::string& production = grammar.Successor(c, params.depth - remaining, SHARED_CHOICE | static_cast<unsigned char>(c));
+            if (!build(production, remaining - 1, false, slot, cached)) return false;
+        }
+        group = cached;
+        return true;
+    }
 
-        case '^':
-            // Pitch up around X-axis
-            currentModel = glm::rotate(currentModel, glm::radians(-angleX), glm::vec3(1.0f, 0.0f, 0.0f));
-            break;
+    static constexpr uint32_t NO_GROUP = 0xFFFFFFFFu;
+    static constexpr uint32_t GROUP_DOMAIN = 0x40000000u;  // above the domains of derivation generations
+    static constexpr uint64_t SHARED_CHOICE = uint64_t(1) << 63;  // above every symbol position
+
+    const LSystemGrammar& grammar;
+    const TurtleProgram& program;
+    const LSystemParameters& params;
+    LSystemInstanceGraph& graph;
+    std::vector<uint32_t> memo;
+};
+
+// Execute a compiled program, on all cores when it is long enough, leaving the leaves as sites.
+// False if `cancel` stopped it
+static bool interpretLSystemSites(const glm::mat4& model, InstanceSink& branchTransforms,
+    std::vector<LeafSite>& leafSites, const TurtleProgram& program, const LSystemParameters& params,
+    const std::atomic<bool>* cancel) {
+    if (program.ops.size() >= PARALLEL_INTERPRET_MIN_OPS) {
+        return interpretLSystemParallel(model, branchTransforms, leafSites, program, params, cancel);
+    }
 
-        case '/':
-            // Yaw right around Y-axis
-            currentModel = glm::rotate(currentModel, glm::radians(angleY), glm::vec3(0.0f, 1.0f, 0.0f));
-            break;
+    LSystemTurtle turtle(model, branchTransforms, leafSites, params, program);
+    return executeLSystemOps(turtle, program, 0, program.ops.size(), cancel);
+}
 
-        case '\\':
-            // Yaw left around Y-axis
-            currentModel = glm::rotate(currentModel, glm::radians(-angleY), glm::vec3(0.0f, 1.0f, 0.0f));
-            break;
+static bool interpretLSystemProgram(const glm::mat4& model, InstanceSink& branchTransforms,
+    InstanceSink& leafTransforms, const TurtleProgram& program, const LSystemParameters& params,
+    const std::atomic<bool>* cancel) {
+    std::vector<LeafSite> leafSites;
+    if (!interpretLSystemSites(model, branchTransforms, leafSites, program, params, cancel)) return false;
+    if (params.leafBudget > 0) {
+        distributeLeafBudget(leafSites, static_cast<uint64_t>(params.leafBudget));
+    }
+    return generateLeafBatch(leafSites, leafTransforms, cancel);
+}
 
-        case '[':
-            // Save the current transformation matrix to the stack
-            transformStack.push(currentModel);
-            break;
+// Report a program that indexes more transforms or widths than an instruction can hold
+static bool tooManyOperands() {
+    std::cerr << "L-system: the tree needs more than " << TurtleProgram::MAX_OPERAND
+        << " distinct transforms or widths, lower the depth" << std::endl;
+    return false;
+}
 
-        case ']':
-            // Restore the last saved transformation matrix from the stack
-            if (!transformStack.empty()) {
-                currentModel = transformStack.top();
-                transformStack.pop();
-            }
-            break;
+// Derive the tree of `params` and compile it into `program`, false if its parametric grammar
+// is invalid, the program does not fit the operands or `cancel` stopped the derivation
+static bool compileLSystemProgram(const LSystemGrammar& grammar, const LSystemParameters& params,
+    LSystemDerivationCache* cache, TurtleProgram& program, const std::atomic<bool>* cancel) {
+    if (LSystemGrammar::IsParametric(params)) {
+        LSystemParametricGrammar parametric(params);
+        if (!parametric.Valid()) {
+            std::cerr << "L-system: " << parametric.Error() << std::endl;
+            return false;
+        }
+        const LSystemModuleString modules = parametric.Expand(params.depth, cancel);
+        if (cancelled(cancel)) return false;
+        if (!program.Compile(modules)) return tooManyOperands();
+    }
+    // Unedited built-in presets were expanded and compiled when the project was built
+    else if (const LSystemPrecompiledProgram* precompiled = FindPrecompiledLSystem(params)) {
+        program.Load(*precompiled);
+    }
+    else if (cache) {
+        // Grammars grown at this depth before, in this run or an earlier one
+        LSystemPrecompiledProgram stored;
+        if (cache->programs && cache->programs->Find(grammar, params.rules, params.depth, stored)) {
+            program.Load(stored);
+            return true;
+        }
+        const std::string& expanded = cache->Expand(grammar, params.rules, params.depth, cancel);
+        if (cancelled(cancel)) return false;
+        if (!program.Compile(expanded)) return tooManyOperands();
+        if (cache->programs) {
+            cache->programs->Add(grammar, params.rules, params.depth, program);
+        }
+    }
+    else if (!program.Compile(grammar.Expand(params.depth))) {
+        return tooManyOperands();
+    }
+    return true;
+}
 
-        case 'L':  // 'L' indicates a leaf point
-			
-            generateLeafTransforms(currentModel, leafTransforms, scale, num_leaves, true);
-            break;
-        default:
-            // Ignore any other symbols
-            break;
+bool Tree::createLSystemInstanceGraph(const LSystemParameters& params, LSystemInstanceGraph& graph) {
+    graph.groups.clear();
+    // Copies of a parametric module differ in their parameters and cannot share a group
+    if (LSystemGrammar::IsParametric(params)) return false;
+
+    LSystemGrammar grammar(params.axiom, params.rules, params.seed, params.contextIgnored);
+    // Neither can copies of a symbol whose production depends on its neighbours
+    if (grammar.IsContextSensitive()) return false;
+
+    TurtleProgram program(params);
+    LSystemInstancer instancer(grammar, program, params, graph);
+
+    if (!instancer.build(params.axiom, params.depth, true, instancer.rootSlot(), graph.root)) {
+        graph.groups.clear();
+        return false;
+    }
+    return true;
+}
+
+int Tree::createBranchesLSystem(glm::mat4 &model, InstanceSink &branchTransforms,
+                                 InstanceSink &leafTransforms, const LSystemParameters& requested,
+                                 LSystemDerivationCache* cache, const std::atomic<bool>* cancel)
+{
+    LSystemGrammar grammar = LSystemGrammar::FromParameters(requested);
+
+    // Refuse depths that would blow through the instance or memory budget
+    LSystemParameters params = requested;
+    params.depth = grammar.ClampDepth(requested);
+
+    // Reserve the predicted upper bounds so the transforms are never reallocated
+    const LSystemSizePrediction prediction = grammar.Predict(params.depth, params.maxLeafCount, params.leafBudget).back();
+    branchTransforms.reserve(static_cast<size_t>(prediction.branches));
+    leafTransforms.reserve(static_cast<size_t>(prediction.leaves));
+
+    if (LSystemGrammar::IsParametric(params)) {
+        // Modules carry their own lengths and angles, so they are always derived into
+        // a packed module buffer: no instancing, streaming or cached string
+        TurtleProgram program(params);
+        if (!compileLSystemProgram(grammar, params, cache, program, cancel)) return 0;
+        if (!interpretLSystemProgram(model, branchTransforms, leafTransforms, program, params, cancel)) return 0;
+        return params.depth;
+    }
+
+    // Exposure depends on where a copy ends up, so a leaf budget needs the flat paths
+    if (params.instanceSubtrees && params.leafBudget <= 0) {
+        // Random choices are made once per group, so every copy of a subtree looks the same
+        // and a seed grows a different tree than the flat paths below
+        LSystemInstanceGraph graph;
+        if (createLSystemInstanceGraph(params, graph)) {
+            if (!graph.Flatten(model, branchTransforms, leafTransforms, cancel)) return 0;
+            return params.depth;
         }
+        // Unbalanced brackets or context-sensitive rules, fall back to a flat derivation
+    }
+
+    TurtleProgram program(params);
+
+    if (params.streamDerivation && !grammar.IsContextSensitive()) {
+        // Interpret each symbol as soon as it is derived, memory stays O(depth).
+        // Context-sensitive rules need whole generations and are expanded below
+        std::vector<LeafSite> leafSites;
+        LSystemTurtle turtle(model, branchTransforms, leafSites, params, program);
+        size_t symbols = 0;
+        const bool derived = grammar.Derive(params.depth, [&](char c) {
+            turtle.interpret(c);
+            return ++symbols % CANCEL_CHECK_OPS != 0 || !cancelled(cancel);
+        });
+        if (!derived) return 0;
+        if (params.leafBudget > 0) {
+            distributeLeafBudget(leafSites, static_cast<uint64_t>(params.leafBudget));
+        }
+        if (!generateLeafBatch(leafSites, leafTransforms, cancel)) return 0;
+        return params.depth;
+    }
+
+    // Apply the L-system rules to expand the axiom string, then compile it into turtle instructions
+    if (!compileLSystemProgram(grammar, params, cache, program, cancel)) return 0;
+    if (!interpretLSystemProgram(model, branchTransforms, leafTransforms, program, params, cancel)) return 0;
+    return params.depth;
+}
+
+int Tree::createForestLSystem(const std::vector<ForestPlacement>& placements, const LSystemParameters& requested,
+    ForestInstances& forest, LSystemDerivationCache* cache, const std::atomic<bool>* cancel) {
+    const size_t treeCount = placements.size();
+    forest.branchTransforms.clear();
+    forest.leafTransforms.clear();
+    forest.branchOffsets.assign(treeCount + 1, 0);
+    forest.leafOffsets.assign(treeCount + 1, 0);
+    if (treeCount == 0) return requested.depth;
+
+    // The instance, memory and leaf budgets cover the whole forest
+    LSystemParameters params = requested;
+    const int trees = static_cast<int>(std::min(treeCount, static_cast<size_t>(INT_MAX)));
+    params.maxInstances = std::max(requested.maxInstances / trees, 1);
+    params.maxMemoryMB = std::max(requested.maxMemoryMB / trees, 1);
+    if (requested.leafBudget > 0) {
+        params.leafBudget = std::max(requested.leafBudget / trees, 1);
+    }
+    LSystemGrammar grammar = LSystemGrammar::FromParameters(params);
+    params.depth = grammar.ClampDepth(params);
+
+    // One derivation is shared by every tree. Stochastic rules choose with the seed,
+    // so those grammars are derived once per distinct seed instead
+    std::vector<TurtleProgram> programs;
+    std::vector<uint32_t> treePrograms(treeCount);
+    std::unordered_map<int, uint32_t> seedPrograms;
+    for (size_t t = 0; t < treeCount; t++) {
+        const int seed = grammar.IsStochastic() ? placements[t].seed : params.seed;
+        auto found = seedPrograms.find(seed);
+        if (found == seedPrograms.end()) {
+            LSystemParameters seeded = params;
+            seeded.seed = seed;
+            programs.emplace_back(params);
+            if (!compileLSystemProgram(LSystemGrammar::FromParameters(seeded), seeded, cache, programs.back(), cancel)) return 0;
+            found = seedPrograms.emplace(seed, static_cast<uint32_t>(programs.size() - 1)).first;
+        }
+        treePrograms[t] = found->second;
+    }
+
+    // Trees differ in their random draws only, through the turtle's seed
+    std::vector<LSystemParameters> treeParams(treeCount, params);
+    for (size_t t = 0; t < treeCount; t++) {
+        treeParams[t].seed = placements[t].seed;
+    }
+
+    std::vector<std::vector<AffineInstance>> branches(treeCount);
+    std::vector<std::vector<LeafSite>> leafSites(treeCount);
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    const long long treeTotal = static_cast<long long>(treeCount);
+    if (treeTotal >= threads) {
+        // A tree per core at a time
+        #pragma omp parallel for schedule(dynamic)
+        for (long long t = 0; t < treeTotal; t++) {
+            const TurtleProgram& program = programs[treePrograms[t]];
+            VectorInstanceSink treeBranches(branches[t]);
+            LSystemTurtle turtle(placements[t].root, treeBranches, leafSites[t], treeParams[t], program);
+            executeLSystemOps(turtle, program, 0, program.ops.size(), cancel);
+        }
+    }
+    else {
+        // Fewer trees than cores, each tree is split between the cores instead
+        for (size_t t = 0; t < treeCount; t++) {
+            VectorInstanceSink treeBranches(branches[t]);
+            if (!interpretLSystemSites(placements[t].root, treeBranches, leafSites[t], programs[treePrograms[t]], treeParams[t], cancel)) break;
+        }
+    }
+    if (cancelled(cancel)) return 0;
+
+    // Concatenate the trees, then generate every leaf straight into its slice
+    std::vector<size_t> siteOffsets(treeCount + 1, 0);
+    for (size_t t = 0; t < treeCount; t++) {
+        if (params.leafBudget > 0) {
+            distributeLeafBudget(leafSites[t], static_cast<uint64_t>(params.leafBudget));
+        }
+        size_t leaves = 0;
+        for (const LeafSite& site : leafSites[t]) {
+            leaves += site.count;
+        }
+        forest.branchOffsets[t + 1] = forest.branchOffsets[t] + branches[t].size();
+        forest.leafOffsets[t + 1] = forest.leafOffsets[t] + leaves;
+        siteOffsets[t + 1] = siteOffsets[t] + leafSites[t].size();
+    }
+    forest.branchTransforms.resize(forest.branchOffsets.back());
+    std::vector<LeafSite> forestSites(siteOffsets.back());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (long long t = 0; t < treeTotal; t++) {
+        std::copy(branches[t].begin(), branches[t].end(), forest.branchTransforms.begin() + forest.branchOffsets[t]);
+        std::copy(leafSites[t].begin(), leafSites[t].end(), forestSites.begin() + siteOffsets[t]);
     }
+    VectorInstanceSink forestLeaves(forest.leafTransforms);
+    if (!generateLeafBatch(forestSites, forestLeaves, cancel)) return 0;
+    return params.depth;
 }
 
-void spaceColonizationGrow(std::vector<TreeNode>& tree_nodes, TreeNode& parent, glm::mat4& model, 
-    std::vector<glm::mat4>& branchTransforms, 
-    std::vector<glm::mat4>& leafTransforms,
-    float radius, int depth) {
-    if (parent.children.empty() || depth > 100) return;
+void spaceColonizationGrow(const TreeNodeManager& tree_nodes, size_t parent, glm::mat4& model, 
+    InstanceSink& branchTransforms, 
+    std::vector<LeafSite>& leafSites,
+    float radius, int depth, uint32_t seed) {
+    if (tree_nodes.first_children[parent] == -1 || depth > 100) return;
 
-    for (size_t child_i : parent.children) {
-        TreeNode child_node = tree_nodes[child_i];
+    const glm::vec3 parent_position = tree_nodes.positions[parent];
+    const float parent_radius = tree_nodes.radii[parent];
+    for (int32_t child_i = tree_nodes.first_children[parent]; child_i != -1; child_i = tree_nodes.next_siblings[child_i]) {
+        const glm::vec3 child_position = tree_nodes.positions[child_i];
         glm::mat4 child_branch = model;
 
         // Calculate direction vector from parent to current node
-        glm::vec3 direction = child_node.position - parent.position;
+        glm::vec3 direction = child_position - parent_position;
         direction = glm::normalize(direction);
         
-        child_branch = glm::translate(child_branch, parent.position);
+        child_branch = glm::translate(child_branch, parent_position);
         // Calculate rotation to align with direction vector
         // Default up vector is (0,1,0)
         if (direction != glm::vec3(0.0f, 1.0f, 0.0f)) {
@@ -203,41 +689,41 @@ void spaceColonizationGrow(std::vector<TreeNode>& tree_nodes, TreeNode& parent,
             float rotationAngle = acos(glm::dot(glm::vec3(0.0f, 1.0f, 0.0f), direction));
             child_branch = glm::rotate(child_branch, rotationAngle, rotationAxis);
         }
-        child_branch = glm::scale(child_branch, glm::vec3(parent.radius, 1.0f + 0.1f * parent.radius, parent.radius));
+        child_branch = glm::scale(child_branch, glm::vec3(parent_radius, 1.0f + 0.1f * parent_radius, parent_radius));
 
-        branchTransforms.push_back(child_branch);
-        std::random_device rd;  // Seed the random number generator
-        std::mt19937 gen(rd()); // Mersenne Twister engine
-        std::uniform_int_distribution<> dis(0, 12);
-        int num_leaves = dis(gen);
+        branchTransforms.append(AffineInstance(child_branch));
+        // Leaves of a node are keyed by its index
+        CounterRng rng(seed, child_i);
+        int num_leaves = rng.UniformInt(0, 12);
 
         glm::mat4 leaf = model;
-        leaf = glm::translate(leaf, child_node.position);
+        leaf = glm::translate(leaf, child_position);
         if (direction != glm::vec3(0.0f, 1.0f, 0.0f)) {
             glm::vec3 rotationAxis = glm::cross(glm::vec3(0.0f, 1.0f, 0.0f), direction);
             float rotationAngle = acos(glm::dot(glm::vec3(0.0f, 1.0f, 0.0f), direction));
             leaf = glm::rotate(leaf, rotationAngle, rotationAxis);
         }
-        leaf = glm::scale(leaf, glm::vec3(parent.radius, 1.0f, parent.radius));
+        leaf = glm::scale(leaf, glm::vec3(parent_radius, 1.0f, parent_radius));
 
-        generateLeafTransforms(leaf, leafTransforms, 0.3f, num_leaves, false);
+        // Draw 0 picked the count, the leaves draw from 1 on
+        leafSites.push_back({ leaf, static_cast<uint64_t>(child_i), seed, 0, 1, static_cast<uint32_t>(num_leaves), 0.3f, false });
 
-        spaceColonizationGrow(tree_nodes, tree_nodes[child_i], model, branchTransforms, leafTransforms, radius, depth + 1);
+        spaceColonizationGrow(tree_nodes, child_i, model, branchTransforms, leafSites, radius, depth + 1, seed);
     }
 }
 
-void Tree::createBranchesSpaceColonization(std::vector<TreeNode>& tree_nodes, glm::mat4& model, 
-    std::vector<glm::mat4>& branchTransforms, std::vector<glm::mat4>& leafTransforms,
+void Tree::createBranchesSpaceColonization(const TreeNodeManager& tree_nodes, glm::mat4& model, 
+    InstanceSink& branchTransforms, InstanceSink& leafTransforms,
     float radius, int depth, int root_nodes) {
     // branchTransforms.push_back(model);
     for (size_t i = 1; i < root_nodes; i++) {
         glm::mat4 main_branch = model;
 
         // Calculate direction vector from parent to current node
-        glm::vec3 direction = tree_nodes[i].position - tree_nodes[i-1].position;
+        glm::vec3 direction = tree_nodes.positions[i] - tree_nodes.positions[i - 1];
         direction = glm::normalize(direction);
 
-        main_branch = glm::translate(main_branch, tree_nodes[i - 1].position);
+        main_branch = glm::translate(main_branch, tree_nodes.positions[i - 1]);
 
         // Calculate rotation to align with direction vector
         // Default up vector is (0,1,0)
@@ -248,10 +734,14 @@ void Tree::createBranchesSpaceColonization(std::vector<TreeNode>& tree_nodes, gl
         }
         main_branch = glm::scale(main_branch, glm::vec3(1.0f, 1.0f + 0.1f, 1.0f));
 
-        branchTransforms.push_back(main_branch);
+        branchTransforms.append(AffineInstance(main_branch));
     }
 
+    // One seed per tree instead of one random device per node
+    const uint32_t seed = std::random_device()();
+    std::vector<LeafSite> leafSites;
     for (size_t i = 0; i < root_nodes; i++) {
-        spaceColonizationGrow(tree_nodes, tree_nodes[i], model, branchTransforms, leafTransforms,  radius, depth + 1);
+        spaceColonizationGrow(tree_nodes, i, model, branchTransforms, leafSites,  radius, depth + 1, seed);
     }
+    generateLeafBatch(leafSites, leafTransforms);
 }
\ No newline at end of file
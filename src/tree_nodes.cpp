@@ -28,8 +28,6 @@ void TreeNodeManager::InitializeTreeNodes(int initial_num) {
     std::uniform_real_distribution<float> angle_dist(0.0f, 1.0f * M_PI);
 
     for (int i = 0; i < initial_num; i++) {
-        TreeNode node;
-
         // Generate random radius and angle
         float r = radius_dist(gen);
         float theta = angle_dist(gen);
@@ -38,68 +36,77 @@ void TreeNodeManager::InitializeTreeNodes(int initial_num) {
         float x = r * cos(theta);
         float z = r * sin(theta);
 
-        node.position = { x, node_interval * i, z };
-        node.linked_points.clear();
-
-        node.parent = -1;
-        node.children.clear();
-        node.radius = 1.0f;
+        AddNode({ x, node_interval * i, z }, -1, 1.0f);
+    }
+}
 
-        tree_nodes.push_back(node);
+size_t TreeNodeManager::AddNode(const glm::vec3& position, int32_t parent, float radius) {
+    const size_t node = positions.size();
+    positions.push_back(position);
+    parents.push_back(parent);
+    radii.push_back(radius);
+    first_children.push_back(-1);
+    next_siblings.push_back(-1);
+    if (parent != -1) {
+        next_siblings[node] = first_children[parent];
+        first_children[parent] = static_cast<int32_t>(node);
     }
+    return node;
 }
 
-bool TreeNodeManager::GrowNewNodes(float growth_distance) {
-    const size_t original_size = tree_nodes.size();
-    std::vector<TreeNode> new_nodes;
-    new_nodes.reserve(tree_nodes.size() / 2);
+bool TreeNodeManager::GrowNewNodes(float growth_distance, const AttractionPointStore& attraction_points,
+    const NodePointLinks& links) {
+    const size_t original_size = Size();
 
-    #pragma omp parallel for if(tree_nodes.size() > 1000)
-    for (size_t i = 0; i < original_size; i++) {
-        TreeNode& tree_node = tree_nodes[i];
-        if (tree_node.linked_points.empty()) continue;
+    // Where every node grows to this step, if it does
+    scratch.Reset();
+    glm::vec3* new_positions = scratch.Allocate<glm::vec3>(original_size);
+    uint8_t* grows = scratch.Allocate<uint8_t>(original_size);
+
+    #pragma omp parallel for if(original_size > 1000)
+    for (long long i = 0; i < static_cast<long long>(original_size); i++) {
+        grows[i] = 0;
+        if (links.Empty(i)) continue;
         
-        glm::vec3 growth_dir = GrowthDirection(tree_node);
+        glm::vec3 growth_dir = GrowthDirection(i, attraction_points, links);
 
         if (growth_dir.y < -0.02f) continue;
 
         if (glm::length(growth_dir) > 0.001f) {
-            glm::vec3 new_pos = tree_node.position + growth_dir * growth_distance;
+            glm::vec3 new_pos = positions[i] + growth_dir * growth_distance;
 
             bool child_repeat = false;
             // Check if the child has already been created
-            for (size_t child : tree_node.children) {
-                if (glm::length(new_pos - tree_nodes[child].position) < 0.000001f) {
+            for (int32_t child = first_children[i]; child != -1; child = next_siblings[child]) {
+                if (glm::length(new_pos - positions[child]) < 0.000001f) {
                     child_repeat = true;
                     break;
                 }
             }
 
             if (!child_repeat) {
-                TreeNode child_node;
-                child_node.position = new_pos;
-                child_node.parent = i;
-                child_node.radius = 0.2f + (tree_node.radius - 0.2f) * 0.85f;
-
-                #pragma omp critical
-                {
-                    tree_node.children.push_back(tree_nodes.size() + new_nodes.size());
-                    new_nodes.push_back(child_node);
-                }
+                new_positions[i] = new_pos;
+                grows[i] = 1;
             }
         }
     }
-    if (!new_nodes.empty()) {
-        tree_nodes.insert(tree_nodes.end(), new_nodes.begin(), new_nodes.end());
-        return true;
+
+    // Appended in node order, so the tree is the same for any number of threads
+    bool grew = false;
+    for (size_t i = 0; i < original_size; i++) {
+        if (!grows[i]) continue;
+        AddNode(new_positions[i], static_cast<int32_t>(i), 0.2f + (radii[i] - 0.2f) * 0.85f);
+        grew = true;
     }
-    return false;
+    return grew;
 }
 
-glm::vec3 TreeNodeManager::GrowthDirection(TreeNode& node) {
+glm::vec3 TreeNodeManager::GrowthDirection(size_t node, const AttractionPointStore& attraction_points,
+    const NodePointLinks& links) {
     glm::vec3 growth_dir(0.0f);
-    for (AttractionPoint* point : node.linked_points) {
-        glm::vec3 dir = point->position - node.position;
+    const glm::vec3 position = positions[node];
+    for (uint32_t j = links.Begin(node); j < links.End(node); j++) {
+        glm::vec3 dir = attraction_points.Position(links.point_indices[j]) - position;
         float length = glm::length(dir);
         if (length > 0.001f) {
             growth_dir += dir / length; // Normalized direction
@@ -116,34 +123,37 @@ glm::vec3 TreeNodeManager::GrowthDirection(TreeNode& node) {
 }
 
 
-void TreeNodeManager::DebugPrintNodes() {
-    for (auto& node : tree_nodes) {
-        printf("Tree Node (%f, %f, %f)\n", node.position.x, node.position.y, node.position.z);
-        if (node.parent == -1) {
+void TreeNodeManager::DebugPrintNodes(const AttractionPointStore& attraction_points, const NodePointLinks& links) {
+    for (size_t i = 0; i < Size(); i++) {
+        const glm::vec3& position = positions[i];
+        printf("Tree Node (%f, %f, %f)\n", position.x, position.y, position.z);
+        if (parents[i] == -1) {
             printf("\tParent Node: N/A\n");
         }
         else {
-            printf("\tParent Node: (%f, %f, %f)\n", tree_nodes[node.parent].position.x, tree_nodes[node.parent].position.y, tree_nodes[node.parent].position.z);
+            const glm::vec3& parent = positions[parents[i]];
+            printf("\tParent Node: (%f, %f, %f)\n", parent.x, parent.y, parent.z);
         }
 
         printf("\tChildren Node: \n");
-        if (node.children.empty()) {
+        if (first_children[i] == -1) {
             printf("\t\tN/A\n");
         }
         else {
-            for (auto child : node.children) {
-                printf("\t\t(%f, %f, %f)\n", tree_nodes[child].position.x, tree_nodes[child].position.y, tree_nodes[child].position.z);
+            for (int32_t child = first_children[i]; child != -1; child = next_siblings[child]) {
+                printf("\t\t(%f, %f, %f)\n", positions[child].x, positions[child].y, positions[child].z);
             }
 
         }
 
         printf("\tLinked to Points: \n");
-        if (node.linked_points.empty()) {
+        if (links.Empty(i)) {
             printf("\t\tN/A\n");
         }
         else {
-            for (auto& point : node.linked_points) {
-                printf("\t\t(%f, %f, %f)\n", point->position.x, point->position.y, point->position.z);
+            for (uint32_t j = links.Begin(i); j < links.End(i); j++) {
+                const glm::vec3 point = attraction_points.Position(links.point_indices[j]);
+                printf("\t\t(%f, %f, %f)\n", point.x, point.y, point.z);
             }
            
         }